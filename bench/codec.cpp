@@ -0,0 +1,153 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: UDP decoder benchmark: json11 DOM vs streaming UdpMessage vs Tempest::WriteUdp
+//
+// Usage:       make bench
+//              build/<os>_<cpu>/bench/codec [file]   file: recorded datagrams, one JSON message per line
+//
+
+// Includes -------------------------------------------------------------------------------------------------------------------
+
+#include <system.hpp>
+
+#include "log.hpp"
+#include "udp.hpp"
+#include "codec.hpp"
+
+// Source ---------------------------------------------------------------------------------------------------------------------
+
+using namespace std;
+using namespace tempest;
+
+static const char* const packets_[] = {
+  "{\"serial_number\":\"SK-00008453\",\"type\":\"evt_precip\",\"hub_sn\":\"HB-00000001\",\"evt\":[1493322445]}",
+  "{\"serial_number\":\"AR-00004049\",\"type\":\"evt_strike\",\"hub_sn\":\"HB-00000001\",\"evt\":[1493322445,27,3848]}",
+  "{\"serial_number\":\"SK-00008453\",\"type\":\"rapid_wind\",\"hub_sn\":\"HB-00000001\",\"ob\":[1493322445,2.3,128]}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"rapid_wind\",\"hub_sn\":\"HB-00013030\",\"ob\":[1588948614,0.27,144]}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"rapid_wind\",\"hub_sn\":\"HB-00013030\",\"ob\":[1588948617,0.31,151]}",
+  "{\"serial_number\":\"AR-00004049\",\"type\":\"obs_air\",\"hub_sn\":\"HB-00000001\",\"obs\":[[1493164835,835.0,10.0,45,0,0,3.46,1]],\"firmware_revision\":17}",
+  "{\"serial_number\":\"SK-00008453\",\"type\":\"obs_sky\",\"hub_sn\":\"HB-00000001\",\"obs\":[[1493321340,9000,10,0.0,2.6,4.6,7.4,187,3.12,1,130,null,0,3]],\"firmware_revision\":29}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"obs_st\",\"hub_sn\":\"HB-00013030\",\"obs\":[[1588948614,0.18,0.22,0.27,144,6,1017.57,22.37,50.26,328,0.03,3,0.000000,0,0,0,2.410,1]],\"firmware_revision\":129}",
+  "{\"serial_number\":\"AR-00004049\",\"type\":\"device_status\",\"hub_sn\":\"HB-00000001\",\"timestamp\":1510855923,\"uptime\":2189,\"voltage\":3.50,\"firmware_revision\":17,\"rssi\":-17,\"hub_rssi\":-87,\"sensor_status\":7,\"debug\":1}",
+  "{\"serial_number\":\"HB-00013030\",\"type\":\"hub_status\",\"firmware_revision\":\"171\",\"uptime\":1670133,\"rssi\":-62,\"timestamp\":1495724691,\"reset_flags\":\"BOR,PIN,POR\",\"seq\":48,\"fs\":[1,0,15675411,524288],\"radio_stats\":[2,1,0,3],\"mqtt_stats\":[1,0]}",
+  nullptr
+};
+
+static double Json11(const vector<string>& packets) {
+  //
+  // What WriteUdp used to do: build the DOM, then look up the type, ids and a handful of array elements
+  //
+  double sum = 0;
+  string err;
+
+  for (const string& packet: packets) {
+    Json event = Json::parse(packet.c_str(), err);
+
+    sum += event["type"].string_value().size() + event["hub_sn"].string_value().size() + event["serial_number"].string_value().size();
+    sum += event["firmware_revision"].number_value();
+
+    const Json::array& obs = event["obs"].array_items();
+    for (size_t idx = 0; idx < obs.size(); idx++) {
+      const Json::array& evt = obs[idx].array_items();
+      for (size_t fld = 0; fld < evt.size(); fld++) sum += evt[fld].number_value();
+    }
+
+    const Json::array& ob = event["ob"].array_items();
+    for (size_t fld = 0; fld < ob.size(); fld++) sum += ob[fld].number_value();
+  }
+
+  return (sum);
+}
+
+static double Stream(const vector<string>& packets) {
+  //
+  // The same work through the streaming decoder
+  //
+  double sum = 0;
+  UdpMessage event;
+
+  for (const string& packet: packets) {
+    event.Parse(packet.c_str(), packet.size());
+
+    sum += event.type.size() + event.hub_sn.size() + event.serial_number.size();
+    sum += event.firmware_revision;
+
+    for (size_t idx = 0; idx < event.obs_size; idx++) {
+      for (size_t fld = 0; fld < event.obs[idx].size; fld++) sum += event.obs[idx][fld];
+    }
+
+    for (size_t fld = 0; fld < event.ob.size; fld++) sum += event.ob[fld];
+  }
+
+  return (sum);
+}
+
+static double Codec(const vector<string>& packets, Tempest& tempest, Log& log) {
+  //
+  // End to end: decode and apply to the hub/sensor structures
+  //
+  double sum = 0;
+  bool notify;
+
+  for (const string& packet: packets) sum += tempest.WriteUdp(log, packet.c_str(), packet.size(), notify);
+
+  return (sum);
+}
+
+template<typename F>
+static void Run(const char* name, const vector<string>& packets, size_t bytes, size_t rounds, F func) {
+  double sink = 0;
+
+  auto start = chrono::steady_clock::now();
+  for (size_t round = 0; round < rounds; round++) sink += func(packets);
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  double count = (double)packets.size() * rounds;
+
+  cout << left << setw(22) << name << right << fixed << setprecision(0)
+       << setw(12) << (count / elapsed) << " msg/s"
+       << setw(10) << setprecision(1) << (elapsed * 1e9 / count) << " ns/msg"
+       << setw(10) << setprecision(1) << ((double)bytes * rounds / elapsed / 1e6) << " MB/s"
+       << "   (" << (sink != 0) << ")" << endl;
+}
+
+int main(int argc, char* const argv[]) {
+  vector<string> packets;
+
+  if (argc > 1) {
+    // Recorded datagrams (i.e. captured with tempest --trace)
+    ifstream file{argv[1]};
+    string line;
+    while (getline(file, line)) if (!line.empty()) packets.push_back(line);
+  }
+  else {
+    for (size_t idx = 0; packets_[idx]; idx++) packets.push_back(packets_[idx]);
+  }
+
+  if (packets.empty()) {
+    cerr << "No packets to decode." << endl;
+    return (EXIT_FAILURE);
+  }
+
+  size_t bytes = 0;
+  for (const string& packet: packets) bytes += packet.size();
+
+  size_t rounds = max<size_t>(1, 2000000 / packets.size());
+
+  Log log{Log::Facility::user, Log::Level::emergency};
+  Tempest tempest;
+
+  cout << "Packets: " << packets.size() << " (" << bytes << " bytes), rounds: " << rounds << endl;
+
+  Run("json11 DOM", packets, bytes, rounds, Json11);
+  Run("UdpMessage stream", packets, bytes, rounds, Stream);
+  Run("Tempest::WriteUdp", packets, bytes, rounds, [&](const vector<string>& p) { return (Codec(p, tempest, log)); });
+
+  return (EXIT_SUCCESS);
+}
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,203 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: Ecowitt encoder benchmark: ostringstream vs preformatted Ecowitt buffer vs Tempest::ReadEcowitt
+//
+// Usage:       make bench
+//              build/<os>_<cpu>/bench/ecowitt
+//
+
+// Includes -------------------------------------------------------------------------------------------------------------------
+
+#include <system.hpp>
+
+#include "log.hpp"
+#include "convert.hpp"
+#include "ecowitt.hpp"
+#include "codec.hpp"
+
+// Source ---------------------------------------------------------------------------------------------------------------------
+
+using namespace std;
+using namespace tempest;
+
+static const char* const packets_[] = {
+  "{\"serial_number\":\"HB-00013030\",\"type\":\"hub_status\",\"firmware_revision\":\"171\",\"uptime\":1670133,\"rssi\":-62,\"timestamp\":1495724691,\"reset_flags\":\"BOR,PIN,POR\",\"seq\":48,\"fs\":[1,0,15675411,524288],\"radio_stats\":[2,1,0,3],\"mqtt_stats\":[1,0]}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"evt_strike\",\"hub_sn\":\"HB-00013030\",\"evt\":[1588948610,27,3848]}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"obs_st\",\"hub_sn\":\"HB-00013030\",\"obs\":[[1588948614,0.18,0.22,0.27,144,6,1017.57,22.37,50.26,328,0.03,3,0.000000,0,0,0,2.410,1]],\"firmware_revision\":129}",
+  "{\"serial_number\":\"ST-00000512\",\"type\":\"obs_st\",\"hub_sn\":\"HB-00013030\",\"obs\":[[1588948674,0.21,0.45,0.93,150,6,1017.55,22.41,50.11,331,0.03,3,0.120000,1,0,0,2.410,1]],\"firmware_revision\":129}",
+  nullptr
+};
+
+struct Sample {
+  //
+  // The values of a Tempest sensor payload, already converted to imperial units
+  //
+  string passkey = "HB-00013030";
+  string model = "WF-HB01";
+  int version = 171;
+  time_t timestamp = 1495724691;
+  int rssi = -62;
+  double value[32];
+  time_t lightning_time = 1588948610;
+  int lightning_num = 2;
+};
+
+static void Legacy(const Sample& sample, size_t channel, vector<string>& data) {
+  //
+  // What ReadEcowitt used to do for each sensor
+  //
+  ostringstream event;
+  string ch = "_wf" + std::to_string(channel) + "=";
+  const double* v = sample.value;
+
+  event.str("");
+  event << "PASSKEY=" << sample.passkey;
+  event << "&stationtype=" << sample.model << "_V" << sample.version << ".0.0";
+  event << "&dateutc=" << Convert::epoch_to_dateutc(sample.timestamp);
+  event << "&batt" << ch << v[0];
+  event << "&tempf" << ch << v[1];
+  event << "&humidity" << ch << v[2];
+  event << "&baromrelin" << ch << "0";
+  event << "&baromabsin" << ch << v[3];
+  event << "&lightning" << ch << v[4];
+  event << "&lightning_time" << ch << sample.lightning_time;
+  event << "&lightning_energy" << ch << v[5];
+  event << "&lightning_num" << ch << sample.lightning_num;
+  event << "&uv" << ch << v[6];
+  event << "&solarradiation" << ch << v[7];
+  event << "&rainratein" << ch << v[8];
+  event << "&eventrainin" << ch << v[9];
+  event << "&hourlyrainin" << ch << v[10];
+  event << "&dailyrainin" << ch << v[11];
+  event << "&weeklyrainin" << ch << v[12];
+  event << "&monthlyrainin" << ch << v[13];
+  event << "&yearlyrainin" << ch << v[14];
+  event << "&totalrainin" << ch << v[15];
+  event << "&winddir" << ch << v[16];
+  event << "&winddir_avg10m" << ch << v[17];
+  event << "&windspeedmph" << ch << v[18];
+  event << "&windspdmph_avg10m" << ch << v[19];
+  event << "&windgustmph" << ch << v[20];
+  event << "&maxdailygust" << ch << v[21];
+  event << "&freq=RSSI" << sample.rssi;
+  event << "&model=" << sample.model;
+
+  if (!(event.str().empty())) data.emplace_back(event.str());
+}
+
+static void Preformatted(const Sample& sample, size_t channel, Ecowitt& event, vector<string>& data) {
+  //
+  // The same payload through the Ecowitt encoder
+  //
+  const double* v = sample.value;
+
+  event.Clear(channel);
+  event.Put(Ecowitt::PASSKEY, sample.passkey);
+  event.Put(Ecowitt::STATIONTYPE, sample.model);
+  event.Append("_V");
+  event.Append(sample.version);
+  event.Append(".0.0");
+  event.Put(Ecowitt::DATEUTC, Ecowitt::Date{sample.timestamp});
+  event.Put(Ecowitt::BATT, v[0]);
+  event.Put(Ecowitt::TEMPF, v[1]);
+  event.Put(Ecowitt::HUMIDITY, v[2]);
+  event.Put(Ecowitt::BAROMRELIN, 0);
+  event.Put(Ecowitt::BAROMABSIN, v[3]);
+  event.Put(Ecowitt::LIGHTNING, v[4]);
+  event.Put(Ecowitt::LIGHTNING_TIME, sample.lightning_time);
+  event.Put(Ecowitt::LIGHTNING_ENERGY, v[5]);
+  event.Put(Ecowitt::LIGHTNING_NUM, sample.lightning_num);
+  event.Put(Ecowitt::UV, v[6]);
+  event.Put(Ecowitt::SOLARRADIATION, v[7]);
+  event.Put(Ecowitt::RAINRATEIN, v[8]);
+  event.Put(Ecowitt::EVENTRAININ, v[9]);
+  event.Put(Ecowitt::HOURLYRAININ, v[10]);
+  event.Put(Ecowitt::DAILYRAININ, v[11]);
+  event.Put(Ecowitt::WEEKLYRAININ, v[12]);
+  event.Put(Ecowitt::MONTHLYRAININ, v[13]);
+  event.Put(Ecowitt::YEARLYRAININ, v[14]);
+  event.Put(Ecowitt::TOTALRAININ, v[15]);
+  event.Put(Ecowitt::WINDDIR, v[16]);
+  event.Put(Ecowitt::WINDDIR_AVG10M, v[17]);
+  event.Put(Ecowitt::WINDSPEEDMPH, v[18]);
+  event.Put(Ecowitt::WINDSPDMPH_AVG10M, v[19]);
+  event.Put(Ecowitt::WINDGUSTMPH, v[20]);
+  event.Put(Ecowitt::MAXDAILYGUST, v[21]);
+  event.Put(Ecowitt::FREQ, sample.rssi);
+  event.Put(Ecowitt::MODEL, sample.model);
+
+  if (event.Size()) data.emplace_back(event.View());
+}
+
+template<typename F>
+static void Run(const char* name, size_t rounds, F func) {
+  vector<string> data;
+  size_t bytes = 0;
+
+  data.reserve(16);
+
+  auto start = chrono::steady_clock::now();
+  for (size_t round = 0; round < rounds; round++) {
+    data.clear();
+    func(data);
+    for (const string& payload: data) bytes += payload.size();
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << left << setw(22) << name << right << fixed << setprecision(0)
+       << setw(12) << (rounds / elapsed) << " payload/s"
+       << setw(10) << setprecision(1) << (elapsed * 1e9 / rounds) << " ns/payload"
+       << setw(10) << setprecision(1) << (bytes / elapsed / 1e6) << " MB/s" << endl;
+}
+
+int main(int argc, char* const argv[]) {
+  Sample sample;
+
+  // Representative values: mixed magnitudes and fractions, as produced by the unit conversions
+  for (size_t idx = 0; idx < sizeof(sample.value) / sizeof(sample.value[0]); idx++) {
+    sample.value[idx] = Convert::km_to_mi(Convert::ms_to_kmh(0.37 * idx + 0.013)) * ((idx % 3)? 1: 100);
+  }
+
+  // Both encoders must produce the same bytes
+  vector<string> legacy, preformatted;
+  Ecowitt ecowitt;
+
+  Legacy(sample, 1, legacy);
+  Preformatted(sample, 1, ecowitt, preformatted);
+
+  if (legacy != preformatted) {
+    cerr << "Encoders disagree:" << endl << legacy[0] << endl << preformatted[0] << endl;
+    return (EXIT_FAILURE);
+  }
+
+  // A relay with one Tempest sensor for the end to end path
+  Log log{Log::Facility::user, Log::Level::emergency};
+  Tempest tempest;
+  bool notify;
+
+  for (size_t idx = 0; packets_[idx]; idx++) tempest.WriteUdp(log, packets_[idx], strlen(packets_[idx]), notify);
+
+  size_t rounds = 1000000;
+
+  cout << "Payload: " << legacy[0].size() << " bytes, rounds: " << rounds << endl;
+
+  Run("ostringstream", rounds, [&](vector<string>& data) { Legacy(sample, 1, data); });
+  Run("Ecowitt", rounds, [&](vector<string>& data) { Preformatted(sample, 1, ecowitt, data); });
+
+  // Only changed sensors are encoded: replay a strike event each round to keep the sensor dirty
+  const char* strike = packets_[1];
+  size_t strike_len = strlen(strike);
+
+  Run("Tempest::ReadEcowitt", rounds, [&](vector<string>& data) {
+    tempest.WriteUdp(log, strike, strike_len, notify);
+    tempest.ReadEcowitt(log, data);
+  });
+
+  return (EXIT_SUCCESS);
+}
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
@@ -17,6 +17,16 @@
 
 #include "log.hpp"
 #include "convert.hpp"
+#include "udp.hpp"
+#include "registry.hpp"
+#include "ecowitt.hpp"
+#include "writer.hpp"
+#include "influx.hpp"
+#include "metrics.hpp"
+#include "snapshot.hpp"
+#include "feed.hpp"
+#include "state.hpp"
+#include "store.hpp"
 
 // Source ---------------------------------------------------------------------------------------------------------------------
 
@@ -24,6 +34,165 @@ namespace tempest {
 
 using namespace std;
 
+// Output formats the transmitter can request from the codec
+
+enum Format {
+  FORMAT_ECOWITT = 0,                                           // Ecowitt query string, one per sensor
+  FORMAT_WEATHERFLOW,                                           // WeatherFlow REST observations/station JSON, one per hub
+  FORMAT_INFLUX,                                                // InfluxDB line protocol, one line per observation
+
+  FORMAT_MAX
+};
+
+//
+// Fixed-capacity ring of recent observations stored as struct-of-arrays: one contiguous column per numeric field so
+// summarizing a field over a window only touches that column (and, for time windows, the timestamp column)
+//
+// Usage:
+//
+// History history{128};
+//
+// history.Push(timestamp, value);                              // value: double[History::FIELD_MAX]
+// History::Summary temp = history.Summarize(History::TEMPERATURE, history.Since(time(nullptr) - 3600));
+// double rain = history.Total(History::PRECIPITATION, since); // NaN if not recorded that far back
+//
+
+class History {
+public:
+
+  enum Field {
+    TEMPERATURE = 0,
+    HUMIDITY,
+    PRESSURE,
+    ILLUMINANCE,
+    UV,
+    SOLAR_RADIATION,
+    PRECIPITATION,
+    WIND_LULL,
+    WIND_SPEED,
+    WIND_GUST,
+    WIND_DIRECTION,
+    BATTERY,
+
+    FIELD_MAX
+  };
+
+  struct Summary {
+    double min;
+    double max;
+    double avg;
+    size_t count;
+  };
+
+  History(size_t capacity): capacity_{max<size_t>(capacity, 1)}, timestamp_(capacity_) {
+    for (size_t field = 0; field < FIELD_MAX; field++) value_[field].resize(capacity_);
+  }
+
+  static inline string_view Name(Field field) { return (name_[field]); }
+
+  inline size_t Capacity(void) const { return (capacity_); }
+  inline size_t Size(void) const { return (min(pushed_, capacity_)); }
+  inline uint64_t Pushed(void) const { return (pushed_); }
+
+  void Push(time_t timestamp, const double value[FIELD_MAX]) {
+    size_t slot = pushed_ % capacity_;
+
+    timestamp_[slot] = timestamp;
+    for (size_t field = 0; field < FIELD_MAX; field++) value_[field][slot] = value[field];
+
+    pushed_++;
+  }
+
+  inline time_t Timestamp(size_t age) const {
+    // age 0 is the newest observation
+    return (timestamp_[Slot(age)]);
+  }
+
+  inline double Value(Field field, size_t age) const {
+    return (value_[field][Slot(age)]);
+  }
+
+  size_t Since(time_t since) const {
+    //
+    // Return how many of the newest observations have a timestamp >= since
+    //
+    size_t size = Size(), age = 0;
+
+    while (age < size && timestamp_[Slot(age)] >= since) age++;
+
+    return (age);
+  }
+
+  Summary Summarize(Field field, size_t count) const {
+    //
+    // Min/max/avg of a field over the newest count observations
+    //
+    Summary sum{0, 0, 0, min(count, Size())};
+
+    if (sum.count) {
+      const vector<double>& column = value_[field];
+
+      sum.min = numeric_limits<double>::max();
+      sum.max = numeric_limits<double>::lowest();
+
+      for (size_t age = 0; age < sum.count; age++) {
+        double value = column[Slot(age)];
+
+        sum.min = min(sum.min, value);
+        sum.max = max(sum.max, value);
+        sum.avg += value;
+      }
+
+      sum.avg /= sum.count;
+    }
+
+    return (sum);
+  }
+
+  double Total(Field field, time_t since) const {
+    //
+    // Sum of a field over the observations with a timestamp >= since, NaN if the history doesn't reach back that far
+    //
+    size_t count = Since(since);
+    double total = 0;
+
+    if (count == Size()) return (numeric_limits<double>::quiet_NaN());
+
+    for (size_t age = 0; age < count; age++) total += value_[field][Slot(age)];
+
+    return (total);
+  }
+
+private:
+
+  inline size_t Slot(size_t age) const {
+    return ((pushed_ - 1 - age) % capacity_);
+  }
+
+  static const string_view name_[FIELD_MAX];                    // see initialization below
+
+  const size_t capacity_;
+  uint64_t pushed_ = 0;
+
+  vector<time_t> timestamp_;
+  vector<double> value_[FIELD_MAX];
+};
+
+const string_view History::name_[History::FIELD_MAX] = {
+  "temperature",                                                // °C
+  "humidity",                                                   // %
+  "pressure",                                                   // mb
+  "illuminance",                                                // lux
+  "uv",                                                         // index
+  "solar_radiation",                                            // W/m²
+  "precipitation",                                              // mm over the observation time span
+  "wind_lull",                                                  // m/s
+  "wind_speed",                                                 // m/s
+  "wind_gust",                                                  // m/s
+  "wind_direction",                                             // degrees
+  "battery"                                                     // volts
+};
+
 class Sensor {
 public:
 
@@ -66,7 +235,7 @@ public:
     bool lightning_failed       : 1;                              // 0b000000001
   };
 
-  Sensor(const string& id, size_t queue_max): id_{id}, model_{GetModel(id)}, queue_max_{queue_max} {
+  Sensor(const string& id, size_t queue_max): id_{id}, model_{GetModel(id)}, queue_max_{queue_max}, history_{queue_max} {
 
     memset(&precipitation_, 0, sizeof(precipitation_));
     memset(&lightning_, 0, sizeof(lightning_));
@@ -77,141 +246,222 @@ public:
     memset(&event_stats_, 0, sizeof(event_stats_));
   }
 
-  size_t UdpPrecipitation(const Json& event) {
-    const Json::array& evt = event["evt"].array_items();
+  void Save(StateRecord& record) const {
+    //
+    // Fill record with the accumulations (the hub is the caller's)
+    //
+    Snapshot::Copy(record.sensor, sizeof(record.sensor), id_);
+
+    record.track.year = obs_stats_.track.tm_year;
+    record.track.month = obs_stats_.track.tm_mon;
+    record.track.yday = obs_stats_.track.tm_yday;
+    record.track.wday = obs_stats_.track.tm_wday;
+    record.track.hour = obs_stats_.track.tm_hour;
+
+    record.precip_rate = obs_stats_.precip_rate;
+    record.precip_event = obs_stats_.precip_event;
+    record.precip_hourly = obs_stats_.precip_hourly;
+    record.precip_daily = obs_stats_.precip_daily;
+    record.precip_weekly = obs_stats_.precip_weekly;
+    record.precip_monthly = obs_stats_.precip_monthly;
+    record.precip_yearly = obs_stats_.precip_yearly;
+    record.precip_total = obs_stats_.precip_total;
+
+    record.wind_direction = obs_stats_.wind_direction;
+    record.wind_direction_avg10m = obs_stats_.wind_direction_avg10m;
+    record.wind_speed = obs_stats_.wind_speed;
+    record.wind_speed_avg10m = obs_stats_.wind_speed_avg10m;
+    record.wind_gust = obs_stats_.wind_gust;
+    record.wind_gust_daily = obs_stats_.wind_gust_daily;
+
+    memcpy(record.wind_sample, obs_stats_.wind_sample, sizeof(record.wind_sample));
+    record.wind_index = obs_stats_.wind_index;
+    record.reserved = 0;
+  }
+
+  void Restore(const StateRecord& record, time_t saved) {
+    //
+    // Resume the accumulations of a previous run saved at saved: the next observation rolls them over as if the relay
+    // never stopped. Wind samples older than their 10 minute window are not resumed
+    //
+    obs_stats_.track.tm_year = record.track.year;
+    obs_stats_.track.tm_mon = record.track.month;
+    obs_stats_.track.tm_yday = record.track.yday;
+    obs_stats_.track.tm_wday = record.track.wday;
+    obs_stats_.track.tm_hour = record.track.hour;
+
+    obs_stats_.precip_rate = record.precip_rate;
+    obs_stats_.precip_event = record.precip_event;
+    obs_stats_.precip_hourly = record.precip_hourly;
+    obs_stats_.precip_daily = record.precip_daily;
+    obs_stats_.precip_weekly = record.precip_weekly;
+    obs_stats_.precip_monthly = record.precip_monthly;
+    obs_stats_.precip_yearly = record.precip_yearly;
+    obs_stats_.precip_total = record.precip_total;
+
+    obs_stats_.wind_direction = record.wind_direction;
+    obs_stats_.wind_direction_avg10m = record.wind_direction_avg10m;
+    obs_stats_.wind_speed = record.wind_speed;
+    obs_stats_.wind_speed_avg10m = record.wind_speed_avg10m;
+    obs_stats_.wind_gust = record.wind_gust;
+    obs_stats_.wind_gust_daily = record.wind_gust_daily;
+
+    if (time(nullptr) - saved <= 600) {
+      memcpy(obs_stats_.wind_sample, record.wind_sample, sizeof(obs_stats_.wind_sample));
+      obs_stats_.wind_index = (size_t)record.wind_index % 10;
+    }
+    else {
+      memset(obs_stats_.wind_sample, 0, sizeof(obs_stats_.wind_sample));
+      obs_stats_.wind_index = 0;
+    }
+  }
+
+  inline bool Stale(time_t now, time_t timeout) const {
+    // Nothing relayable received for timeout seconds (0: never stale)
+    return (timeout && now - updated_ >= timeout);
+  }
+
+  size_t UdpPrecipitation(const UdpMessage& event) {
+    const UdpMessage::Array& evt = event.evt;
 
-    precipitation_.timestamp = evt[0].number_value();
+    precipitation_.timestamp = evt[0];
 
     obs_stats_.PrecipitationStarted(precipitation_.timestamp);
 
+    Changed();
     event_stats_.precipitation++;
     return (1);
   }
 
-  size_t UdpLightning(const Json& event) {
-    const Json::array& evt = event["evt"].array_items();
+  size_t UdpLightning(const UdpMessage& event) {
+    const UdpMessage::Array& evt = event.evt;
 
-    lightning_.timestamp = evt[0].number_value();
-    lightning_.distance = evt[1].number_value();
-    lightning_.energy = evt[2].number_value();
+    lightning_.timestamp = evt[0];
+    lightning_.distance = evt[1];
+    lightning_.energy = evt[2];
 
+    Changed();
     event_stats_.lightning++;
     return (1);
   }
 
-  size_t UdpWind(const Json& event) {
-    const Json::array& evt = event["ob"].array_items();
+  size_t UdpWind(const UdpMessage& event) {
+    const UdpMessage::Array& evt = event.ob;
 
-    wind_.timestamp = evt[0].number_value();
-    wind_.speed = evt[1].number_value();
-    wind_.direction = evt[2].number_value();
+    wind_.timestamp = evt[0];
+    wind_.speed = evt[1];
+    wind_.direction = evt[2];
 
+    Publish();
     event_stats_.wind++;
     return (1);
   }
 
-  size_t UdpObservationAir(const Json& event) {
+  size_t UdpObservationAir(const UdpMessage& event) {
     // We can have a vector of observations (WF developers confirmed oldest is first in the array)
-    const Json::array& obs = event["obs"].array_items();
-    size_t idx, size = obs.size();
+    const UdpMessage::Array* obs = event.obs;
+    size_t idx, size = event.obs_size;
 
-    obs_.version = event["firmware_revision"].number_value();
+    obs_.version = event.firmware_revision;
 
     for (idx = 0; idx < size; idx++) {
-      const Json::array& evt = obs[idx].array_items();
-
-      obs_.timestamp = evt[0].number_value();
-      obs_.pressure = evt[1].number_value();
-      obs_.temperature = evt[2].number_value();
-      obs_.humidity = evt[3].number_value();
-      obs_.lightning_count = evt[4].number_value();
-      obs_.lightning_distance = evt[5].number_value();
-      obs_.battery = evt[6].number_value();
-      obs_.timespan = evt[7].number_value() * 60;
-
+      const UdpMessage::Array& evt = obs[idx];
+
+      obs_.timestamp = evt[0];
+      obs_.pressure = evt[1];
+      obs_.temperature = evt[2];
+      obs_.humidity = evt[3];
+      obs_.lightning_count = evt[4];
+      obs_.lightning_distance = evt[5];
+      obs_.battery = evt[6];
+      obs_.timespan = evt[7] * 60;
+
+      Record();
       event_stats_.observation++;
     }
 
     return (idx);
   }
 
-  size_t UdpObservationSky(const Json& event) {
+  size_t UdpObservationSky(const UdpMessage& event) {
     // We can have a vector of observations (WF developers confirmed oldest is first in the array)
-    const Json::array& obs = event["obs"].array_items();
-    size_t idx, size = obs.size();
+    const UdpMessage::Array* obs = event.obs;
+    size_t idx, size = event.obs_size;
 
-    obs_.version = event["firmware_revision"].number_value();
+    obs_.version = event.firmware_revision;
 
     for (idx = 0; idx < size; idx++) {
-      const Json::array& evt = obs[idx].array_items();
-
-      obs_.timestamp = evt[0].number_value();
-      obs_.illuminance = evt[1].number_value();
-      obs_.uv = evt[2].number_value();
-      obs_.precipitation_accumulation = evt[3].number_value();
-      obs_.wind_lull = evt[4].number_value();
-      obs_.wind_speed = evt[5].number_value();
-      obs_.wind_gust = evt[6].number_value();
-      obs_.wind_direction = evt[7].number_value();
-      obs_.battery = evt[8].number_value();
-      obs_.timespan = evt[9].number_value() * 60;
-      obs_.solar_radiation = evt[10].number_value();
-      // obs_.precipitation_daily_accumulation = evt[11].number_value();
-      obs_.precipitation_type = (Precipitation)evt[12].number_value();
-      obs_.wind_sample = evt[13].number_value();
+      const UdpMessage::Array& evt = obs[idx];
+
+      obs_.timestamp = evt[0];
+      obs_.illuminance = evt[1];
+      obs_.uv = evt[2];
+      obs_.precipitation_accumulation = evt[3];
+      obs_.wind_lull = evt[4];
+      obs_.wind_speed = evt[5];
+      obs_.wind_gust = evt[6];
+      obs_.wind_direction = evt[7];
+      obs_.battery = evt[8];
+      obs_.timespan = evt[9] * 60;
+      obs_.solar_radiation = evt[10];
+      // obs_.precipitation_daily_accumulation = evt[11];
+      obs_.precipitation_type = (Precipitation)evt[12];
+      obs_.wind_sample = evt[13];
 
       obs_stats_.Update(obs_.timestamp, obs_.timespan, obs_.precipitation_accumulation, obs_.wind_direction, obs_.wind_speed, obs_.wind_gust);
+      Record();
       event_stats_.observation++;
     }
 
     return (idx);
   }
 
-  size_t UdpObservationTempest(const Json& event) {
+  size_t UdpObservationTempest(const UdpMessage& event) {
     // We can have a vector of observations (WF developers confirmed oldest is first in the array)
-    const Json::array& obs = event["obs"].array_items();
-    size_t idx, size = obs.size();
+    const UdpMessage::Array* obs = event.obs;
+    size_t idx, size = event.obs_size;
 
-    obs_.version = event["firmware_revision"].number_value();
+    obs_.version = event.firmware_revision;
 
     for (idx = 0; idx < size; idx++) {
-      const Json::array& evt = obs[idx].array_items();
-
-      obs_.timestamp = evt[0].number_value();
-      obs_.wind_lull = evt[1].number_value();
-      obs_.wind_speed = evt[2].number_value();
-      obs_.wind_gust = evt[3].number_value();
-      obs_.wind_direction = evt[4].number_value();
-      obs_.wind_sample = evt[5].number_value();
-      obs_.pressure = evt[6].number_value();
-      obs_.temperature = evt[7].number_value();
-      obs_.humidity = evt[8].number_value();
-      obs_.illuminance = evt[9].number_value();
-      obs_.uv = evt[10].number_value();
-      obs_.solar_radiation = evt[11].number_value();
-      obs_.precipitation_accumulation = evt[12].number_value();
-      obs_.precipitation_type = (Precipitation)evt[13].number_value();
-      obs_.lightning_distance = evt[14].number_value();
-      obs_.lightning_count = evt[15].number_value();
-      obs_.battery = evt[16].number_value();
-      obs_.timespan = evt[17].number_value() * 60;
+      const UdpMessage::Array& evt = obs[idx];
+
+      obs_.timestamp = evt[0];
+      obs_.wind_lull = evt[1];
+      obs_.wind_speed = evt[2];
+      obs_.wind_gust = evt[3];
+      obs_.wind_direction = evt[4];
+      obs_.wind_sample = evt[5];
+      obs_.pressure = evt[6];
+      obs_.temperature = evt[7];
+      obs_.humidity = evt[8];
+      obs_.illuminance = evt[9];
+      obs_.uv = evt[10];
+      obs_.solar_radiation = evt[11];
+      obs_.precipitation_accumulation = evt[12];
+      obs_.precipitation_type = (Precipitation)evt[13];
+      obs_.lightning_distance = evt[14];
+      obs_.lightning_count = evt[15];
+      obs_.battery = evt[16];
+      obs_.timespan = evt[17] * 60;
 
       obs_stats_.Update(obs_.timestamp, obs_.timespan, obs_.precipitation_accumulation, obs_.wind_direction, obs_.wind_speed, obs_.wind_gust);
+      Record();
       event_stats_.observation++;
     }
 
     return (idx);
   }
 
-  size_t UdpStatus(const Json& event) {
-    status_.timestamp = event["timestamp"].number_value();
-    status_.uptime = event["uptime"].number_value();
-    status_.battery = event["voltage"].number_value();
-    status_.version = event["firmware_revision"].number_value();
-    status_.rssi = event["rssi"].number_value();
-    // status_.hub_rssi_ = event["hub_rssi"].number_value();
-    status_.status = event["sensor_status"].number_value();
-    status_.debug = event["debug"].number_value();
+  size_t UdpStatus(const UdpMessage& event) {
+    status_.timestamp = event.timestamp;
+    status_.uptime = event.uptime;
+    status_.battery = event.voltage;
+    status_.version = event.firmware_revision;
+    status_.rssi = event.rssi;
+    // status_.hub_rssi_ = event.hub_rssi;
+    status_.status = event.sensor_status;
+    status_.debug = event.debug;
 
     event_stats_.status++;
     return (1);
@@ -221,6 +471,30 @@ public:
   const Model model_;
   const size_t queue_max_;
 
+  // Recent observations (queue_max_ deep) and how many had been pushed at the last transmitter read in each format
+  History history_;
+  uint64_t history_read_[FORMAT_MAX] = {};
+
+  // Reusable query string buffer for the transmitter
+  Ecowitt ecowitt_;
+
+  // Latest values for the metrics exporter (nullptr if not exported)
+  Metrics::Sensor* metrics_ = nullptr;
+
+  // Latest conditions for local consumers (nullptr if not published)
+  FeedRecord* feed_ = nullptr;
+  StoreSeries* store_ = nullptr;
+
+  // Accumulations of a previous run already looked up
+  bool restored_ = false;
+
+  // Change tracking: generation_ is bumped by every event that alters the relayed payload, generation_read_ is the
+  // generation last encoded by the transmitter in each format and updated_ the wall clock time of the last change
+  uint64_t generation_ = 0;
+  uint64_t generation_read_[FORMAT_MAX] = {};
+  time_t updated_ = time(nullptr);
+  bool stale_ = false;
+
   // Rain Start Event
   struct {
     time_t timestamp;
@@ -328,7 +602,8 @@ public:
         precip_hourly = precip_daily = precip_weekly = precip_monthly = 0;
         wind_gust_daily = 0;
       }
-      else if (roll.tm_wday == 0 && track.tm_wday == 6) {
+      else if (roll.tm_yday - roll.tm_wday != track.tm_yday - track.tm_wday) {
+        // Sunday of the week changed: also after days without observations
         track = roll;
         precip_hourly = precip_daily = precip_weekly = 0;
         wind_gust_daily = 0;
@@ -385,6 +660,74 @@ public:
 
 private:
 
+  void Record(void) {
+    double value[History::FIELD_MAX];
+
+    value[History::TEMPERATURE] = obs_.temperature;
+    value[History::HUMIDITY] = obs_.humidity;
+    value[History::PRESSURE] = obs_.pressure;
+    value[History::ILLUMINANCE] = obs_.illuminance;
+    value[History::UV] = obs_.uv;
+    value[History::SOLAR_RADIATION] = obs_.solar_radiation;
+    value[History::PRECIPITATION] = obs_.precipitation_accumulation;
+    value[History::WIND_LULL] = obs_.wind_lull;
+    value[History::WIND_SPEED] = obs_.wind_speed;
+    value[History::WIND_GUST] = obs_.wind_gust;
+    value[History::WIND_DIRECTION] = obs_.wind_direction;
+    value[History::BATTERY] = obs_.battery;
+
+    history_.Push(obs_.timestamp, value);
+    if (store_) store_->Append(obs_.timestamp, value);
+    if (metrics_) metrics_->Update(obs_.timestamp, value, History::FIELD_MAX);
+    Changed();
+  }
+
+  inline void Changed(void) {
+    generation_++;
+    updated_ = time(nullptr);
+    Publish();
+  }
+
+  void Publish(void) {
+    //
+    // Copy the latest conditions to the shared memory feed
+    //
+    if (!feed_) return;
+
+    feed_->conditions.Write([this](FeedConditions& conditions) {
+      conditions.updated = updated_;
+
+      conditions.obs.timestamp = obs_.timestamp;
+      conditions.obs.timespan = obs_.timespan;
+      conditions.obs.precipitation_type = obs_.precipitation_type;
+      conditions.obs.lightning_count = obs_.lightning_count;
+      conditions.obs.wind_sample = obs_.wind_sample;
+      conditions.obs.battery = obs_.battery;
+      conditions.obs.temperature = obs_.temperature;
+      conditions.obs.humidity = obs_.humidity;
+      conditions.obs.pressure = obs_.pressure;
+      conditions.obs.illuminance = obs_.illuminance;
+      conditions.obs.uv = obs_.uv;
+      conditions.obs.solar_radiation = obs_.solar_radiation;
+      conditions.obs.precipitation_accumulation = obs_.precipitation_accumulation;
+      conditions.obs.lightning_distance = obs_.lightning_distance;
+      conditions.obs.wind_speed = obs_.wind_speed;
+      conditions.obs.wind_lull = obs_.wind_lull;
+      conditions.obs.wind_gust = obs_.wind_gust;
+      conditions.obs.wind_direction = obs_.wind_direction;
+
+      conditions.wind.timestamp = wind_.timestamp;
+      conditions.wind.speed = wind_.speed;
+      conditions.wind.direction = wind_.direction;
+
+      conditions.lightning.timestamp = lightning_.timestamp;
+      conditions.lightning.distance = lightning_.distance;
+      conditions.lightning.energy = lightning_.energy;
+
+      conditions.precipitation.timestamp = precipitation_.timestamp;
+    });
+  }
+
   static Model GetModel(const string& id) {
     if (id.find("AR-") == 0) return (Model::AIR);
     if (id.find("SK-") == 0) return (Model::SKY);
@@ -405,30 +748,22 @@ public:
   class ResetFlags {
   public:
 
-    ResetFlags(const string& list = empty_string) {
+    ResetFlags(string_view list = empty_string) {
       BOR = PIN = POR = SFT = WDG = WWD = LPW = false;
 
-      if (!list.empty()) {
-        // Split comma separated string
-        stringstream flags{list};
-        vector<string> result;
-
-        while(flags.good()) {
-          string substr;
-          getline(flags, substr, ',');
-          result.push_back(substr);
-        }
-
-        for (int i = 0; i < result.size(); i++) {
-          const string& flag = result[i];
-              if (flag == "BOR") BOR = true;
-          else if (flag == "PIN") PIN = true;
-          else if (flag == "POR") POR = true;
-          else if (flag == "SFT") SFT = true;
-          else if (flag == "WDG") WDG = true;
-          else if (flag == "WWD") WWD = true;
-          else if (flag == "LPW") LPW = true;
-        }
+      while (!list.empty()) {
+        // Split comma separated string in place
+        size_t comma = list.find(',');
+        string_view flag = list.substr(0, comma);
+        list = (comma == string_view::npos)? string_view{}: list.substr(comma + 1);
+
+            if (flag == "BOR") BOR = true;
+        else if (flag == "PIN") PIN = true;
+        else if (flag == "POR") POR = true;
+        else if (flag == "SFT") SFT = true;
+        else if (flag == "WDG") WDG = true;
+        else if (flag == "WWD") WWD = true;
+        else if (flag == "LPW") LPW = true;
       }
     }
 
@@ -451,45 +786,38 @@ public:
     memset(&event_stats_, 0, sizeof(event_stats_));
   }
 
-  Sensor& GetSensor(const string& sensor_id) {
-    size_t idx;
-
+  Sensor& GetSensor(string_view sensor_id) {
     assert(!sensor_id.empty());
 
-    for (idx = 0; idx < sensor_.size(); idx++) {
-      if (sensor_[idx].id_ == sensor_id) return (sensor_[idx]);
-    }
-
-    sensor_.emplace_back(sensor_id, queue_max_);
-    return (sensor_[idx]);
+    return (sensor_.Get(sensor_id, string{sensor_id}, queue_max_));
   }
 
-  size_t UdpStatus(const Json& event) {
+  size_t UdpStatus(const UdpMessage& event) {
 
-    status_.version = strtod(event["firmware_revision"].string_value().c_str(), nullptr);
-    status_.timestamp = event["timestamp"].number_value();
+    status_.version = event.firmware_revision;
+    status_.timestamp = event.timestamp;
 
-    status_.uptime = event["uptime"].number_value();
-    status_.rssi = event["rssi"].number_value();
+    status_.uptime = event.uptime;
+    status_.rssi = event.rssi;
 
-    status_.reset = ResetFlags(event["reset_flags"].string_value());
-    status_.seq = event["seq"].number_value();
+    status_.reset = ResetFlags(event.reset_flags);
+    status_.seq = event.seq;
 
-    const Json::array& fs = event["fs"].array_items();
-    status_.fs[0] = fs[0].number_value();
-    status_.fs[1] = fs[1].number_value();
-    status_.fs[2] = fs[2].number_value();
-    status_.fs[3] = fs[3].number_value();
+    const UdpMessage::Array& fs = event.fs;
+    status_.fs[0] = fs[0];
+    status_.fs[1] = fs[1];
+    status_.fs[2] = fs[2];
+    status_.fs[3] = fs[3];
 
-    const Json::array& radio = event["radio_stats"].array_items();
-    status_.radio_version = radio[0].number_value();
-    status_.radio_reboot_count = radio[1].number_value();
-    status_.radio_i2c_bus_err_count = radio[2].number_value();
-    status_.radio = (Radio)radio[3].number_value();
+    const UdpMessage::Array& radio = event.radio_stats;
+    status_.radio_version = radio[0];
+    status_.radio_reboot_count = radio[1];
+    status_.radio_i2c_bus_err_count = radio[2];
+    status_.radio = (Radio)radio[3];
 
-    const Json::array& mqtt = event["mqtt_stats"].array_items();
-    status_.mqtt[0] = mqtt[0].number_value();
-    status_.mqtt[1] = mqtt[1].number_value();
+    const UdpMessage::Array& mqtt = event.mqtt_stats;
+    status_.mqtt[0] = mqtt[0];
+    status_.mqtt[1] = mqtt[1];
 
     event_stats_.status++;
     return (1);
@@ -499,7 +827,7 @@ public:
   const string model_;
   const size_t queue_max_;
 
-  vector<Sensor> sensor_;
+  Registry<Sensor> sensor_;
 
   struct {
     time_t timestamp;
@@ -531,119 +859,201 @@ public:
 class Tempest {
 public:
 
-  Tempest(size_t queue_max = 128): start_time_{time(nullptr)}, queue_max_{queue_max} {
-    memset(&event_stats_, 0, sizeof(event_stats_));
+  Tempest(size_t queue_max = 128, time_t stale = 1800, Metrics* metrics = nullptr, Feed* feed = nullptr, const State* state = nullptr, Store* store = nullptr): start_time_{time(nullptr)}, queue_max_{queue_max}, stale_{stale}, metrics_{metrics}, feed_{feed}, state_{state}, store_{store} {}
+
+  void Save(vector<StateRecord>& records) const {
+    //
+    // Append the accumulations of every sensor that reported at least one observation (State::Save() keeps the
+    // saved ones of the others)
+    //
+    for (size_t i = 0; i < hub_.size(); i++) {
+      const Hub& hub = hub_[i];
+
+      for (size_t j = 0; j < hub.sensor_.size(); j++) {
+        const Sensor& sensor = hub.sensor_[j];
+
+        if (!sensor.event_stats_.observation) continue;
+
+        StateRecord& record = records.emplace_back();
+        memset(&record, 0, sizeof(record));
+        Snapshot::Copy(record.hub, sizeof(record.hub), hub.id_);
+        sensor.Save(record);
+      }
+    }
   }
 
-  string StatsUdp(void) const {
-    ostringstream stats{""};
-    size_t hubs, sensors;
+  void Snapshot(UdpSnapshot& stats) const {
+    //
+    // Fill the fixed-layout statistics --stats prints (hubs and sensors beyond the layout capacity are left out)
+    //
+    stats.start_time = start_time_;
+    stats.stale = stale_;
+    stats.wakeups = udp_stats_.wakeups;
+    stats.datagrams = udp_stats_.datagrams;
+    stats.overflows = udp_stats_.overflows;
+    for (int id = 0; id < UDP_EVENT_MAX; id++) stats.events[id] = event_stats_[id].load(memory_order_relaxed);
 
-    double uptime = difftime(time(nullptr), start_time_);
-    int days = uptime / 86400;
-    uptime -= days * 86400;
-    int hours = uptime / 3600;
-    uptime -= hours * 3600;
-    int minutes = uptime / 60;
-    uptime -= minutes * 60;
-    int seconds = uptime;
-
-    stats << "Uptime: " << days << "d." << hours << "h." << minutes << "m." << seconds << "s" << endl;
-    stats << "Invalid Events: " << event_stats_.invalid << endl;
-    stats << "Debug Events: " << event_stats_.debug << endl;
-    stats << "Unknown Events: " << event_stats_.unknown << endl;
-    hubs = hub_.size();
-    stats << "Hubs: " << hubs << endl;
-    for (size_t i = 0; i < hubs; i++ ) {
+    stats.hubs = min(hub_.size(), UdpSnapshot::HUB_MAX);
+    stats.sensors = 0;
+
+    for (size_t i = 0; i < stats.hubs; i++) {
       const Hub& hub = hub_[i];
-      stats << "[" << i << "]: " << hub.id_ << " " << hub.status_.version << endl;
-      stats << "     Status Events: " << hub.event_stats_.status << endl;
-      sensors = hub.sensor_.size();
-      stats << "     Sensors: " << sensors << endl;
-      for (size_t i = 0; i < sensors; i++ ) {
-        const Sensor& sensor = hub.sensor_[i];
-        stats << "     [" << i << "]: " << sensor.id_ << " " << sensor.status_.version << endl;
-        stats << "          Rain Start Events: " << sensor.event_stats_.precipitation << endl;
-        stats << "          Lightning Strike Events: " << sensor.event_stats_.lightning << endl;
-        stats << "          Rapid wind Events: " << sensor.event_stats_.wind << endl;
-        stats << "          Observation Events: " << sensor.event_stats_.observation << endl;
-        stats << "          Status Events: " << sensor.event_stats_.status << endl;
+      auto& hub_stats = stats.hub[i];
+
+      Snapshot::Copy(hub_stats.id, sizeof(hub_stats.id), hub.id_);
+      hub_stats.version = hub.status_.version;
+      hub_stats.status = hub.event_stats_.status;
+      hub_stats.sensors = 0;
+
+      for (size_t j = 0; j < hub.sensor_.size() && stats.sensors < UdpSnapshot::SENSOR_MAX; j++) {
+        const Sensor& sensor = hub.sensor_[j];
+        auto& sensor_stats = stats.sensor[stats.sensors++];
+
+        Snapshot::Copy(sensor_stats.id, sizeof(sensor_stats.id), sensor.id_);
+        sensor_stats.version = sensor.status_.version;
+        sensor_stats.updated = sensor.updated_;
+        sensor_stats.precipitation = sensor.event_stats_.precipitation;
+        sensor_stats.lightning = sensor.event_stats_.lightning;
+        sensor_stats.wind = sensor.event_stats_.wind;
+        sensor_stats.observation = sensor.event_stats_.observation;
+        sensor_stats.status = sensor.event_stats_.status;
+        sensor_stats.history = sensor.history_.Size();
+        sensor_stats.capacity = sensor.history_.Capacity();
+
+        hub_stats.sensors++;
       }
     }
+  }
+
+  enum Family {
+    FAMILY_WAKEUPS = 0,
+    FAMILY_DATAGRAMS,
+    FAMILY_OVERFLOWS,
+    FAMILY_OBSERVATIONS,
+    FAMILY_EVENTS,
+
+    FAMILY_MAX
+  };
+
+  struct Description {
+    const char* name;
+    const char* type;
+    const char* help;
+  };
+
+  static const Description family_[FAMILY_MAX];                 // see initialization below
+
+  void Expose(string sample[FAMILY_MAX], string_view labels) const {
+    //
+    // Append Prometheus samples, one string per family so the caller can group them across shards. Only reads
+    // atomics: no tempest lock needed
+    //
+    Exposition::Sample(sample[FAMILY_WAKEUPS], family_[FAMILY_WAKEUPS].name, labels, udp_stats_.wakeups);
+    Exposition::Sample(sample[FAMILY_DATAGRAMS], family_[FAMILY_DATAGRAMS].name, labels, udp_stats_.datagrams);
+    Exposition::Sample(sample[FAMILY_OVERFLOWS], family_[FAMILY_OVERFLOWS].name, labels, udp_stats_.overflows);
+    Exposition::Sample(sample[FAMILY_OBSERVATIONS], family_[FAMILY_OBSERVATIONS].name, labels, observations_.load(memory_order_relaxed));
 
-    return (stats.str());
+    string label{labels};
+    if (!label.empty()) label += ',';
+
+    for (int id = 0; id < UDP_EVENT_MAX; id++) {
+      Exposition::Sample(sample[FAMILY_EVENTS], family_[FAMILY_EVENTS].name, label + Exposition::Label("type", UdpMessage::Tag((UdpEvent)id)), event_stats_[id].load(memory_order_relaxed));
+    }
   }
 
-  size_t WriteUdp(Log& log, const char udp[], size_t udp_len, bool& notify) {
+  void UdpReceived(size_t datagrams, size_t overflows = 0) {
+    //
+    // Account for a receiver wakeup: safe to call without holding the tempest lock
+    //
+    udp_stats_.wakeups++;
+    udp_stats_.datagrams += datagrams;
+    udp_stats_.overflows += overflows;
+  }
+
+  inline size_t WriteUdp(Log& log, const char udp[], size_t udp_len, bool& notify) {
+    UdpMessage event;
+    return (WriteUdp(log, udp, udp_len, notify, event));
+  }
+
+  size_t WriteUdp(Log& log, const char udp[], size_t udp_len, bool& notify, UdpMessage& event) {
     //
     // Return the number of events/observation written to tempest
-    // or 0 if error/debug/unrecognized
+    // or 0 if error/debug/unrecognized: if not 0 event holds the decoded message (views into udp)
     //
     size_t obs = 0;
     notify = false;
 
-    string err;
-    Json event = Json::parse(udp, err);
-    if (event == nullptr) {
-      event_stats_.invalid++;
-      TLOG_ERROR(log) << "JSON error: " << err << " parsing: " << udp << "." << endl;
+    // Known events are classified and decoded in place, straight into the hub and sensor structures
+    UdpEvent id = event.Parse(udp, udp_len)? event.event: UDP_INVALID;
+
+    if (id < UDP_DEBUG && (event.serial_number.empty() || (id != UDP_HUB_STATUS && event.hub_sn.empty()))) id = UDP_INVALID;
+
+    event_stats_[id].fetch_add(1, memory_order_relaxed);
+
+    const Handler& handler = handler_[id];
+
+    if (handler.write) {
+      obs = (this->*handler.write)(event);
+      if (obs > 0 && handler.notify) notify = true;
+
+      // Observation events come first in UdpEvent
+      if (id <= UDP_OBS_SKY) observations_.fetch_add(obs, memory_order_relaxed);
+    }
+    else if (id == UDP_UNKNOWN) {
+      TLOG_WARNING(log) << "Unrecognized UDP event: " << udp << "." << endl;
+    }
+    else if (id == UDP_INVALID) {
+      // Only now pay for json11, to report what's wrong
+      string err;
+      if (Json::parse(udp, err) == nullptr) TLOG_ERROR(log) << "JSON error: " << err << " parsing: " << udp << "." << endl;
+      else TLOG_ERROR(log) << "Unsupported UDP event: " << udp << "." << endl;
     }
-    else {
-      const string& type = event["type"].string_value();
 
-      if (type == "hub_status") {
-        Hub& hub = GetHub(event["serial_number"].string_value());
-        obs = hub.UdpStatus(event);
-      }
-      else {
-        Sensor& sensor = GetHub(event["hub_sn"].string_value()).GetSensor(event["serial_number"].string_value());
+    return (obs);
+  }
 
-        if (type == "evt_precip") {
-          obs = sensor.UdpPrecipitation(event);
-          if (obs > 0) notify = true;
-        }
-        else if (type == "evt_strike") {
-          obs = sensor.UdpLightning(event);
-          if (obs > 0) notify = true;
-        }
-        else if (type == "rapid_wind") {
-          obs = sensor.UdpWind(event);
-        }
-        else if (type == "obs_air") {
-          obs = sensor.UdpObservationAir(event);
-        }
-        else if (type == "obs_sky") {
-          obs = sensor.UdpObservationSky(event);
-        }
-        else if (type == "obs_st") {
-          obs = sensor.UdpObservationTempest(event);
-        }
-        else if (type == "device_status") {
-          obs = sensor.UdpStatus(event);
-        }
-        else if (type.find("debug") != string::npos) {
-          event_stats_.debug++;
+  inline uint64_t Observations(void) const {
+    // Observations written so far, for the transmitter to flush line protocol batches early
+    return (observations_.load(memory_order_relaxed));
+  }
+
+  size_t UpdateStale(Log& log) {
+    //
+    // Log sensors going stale or updating again and return how many are stale: called once per transmitter read
+    //
+    size_t hubs, sensors, stale = 0;
+    time_t now = time(nullptr);
+
+    hubs = hub_.size();
+    for (size_t i = 0; i < hubs; i++ ) {
+      Hub& hub = hub_[i];
+      sensors = hub.sensor_.size();
+      for (size_t i = 0; i < sensors; i++ ) {
+        Sensor& sensor = hub.sensor_[i];
+
+        if (sensor.Stale(now, stale_)) {
+          if (!sensor.stale_) TLOG_WARNING(log) << "Sensor " << sensor.id_ << " stale: no updates for " << (now - sensor.updated_) << " seconds." << endl;
+          sensor.stale_ = true;
+          stale++;
         }
-        else {
-          event_stats_.unknown++;
-          TLOG_WARNING(log) << "Unrecognized UDP event: " << udp << "." << endl;
+        else if (sensor.stale_) {
+          sensor.stale_ = false;
+          TLOG_INFO(log) << "Sensor " << sensor.id_ << " updating again." << endl;
         }
       }
     }
 
-    return (obs);
+    return (stale);
   }
 
   size_t ReadEcowitt(Log& log, vector<string>& data) {
     //
-    // Return the number of events/observation read from tempest
+    // Append to data and return the number of events/observation read from tempest
     // or 0 if error
     //
-    data.clear();
+    size_t data_size = data.size();
 
-    ostringstream event;
     size_t hubs, sensors;
-    string ch;
 
     hubs = hub_.size();
     for (size_t i = 0; i < hubs; i++ ) {
@@ -651,96 +1061,361 @@ public:
       sensors = hub.sensor_.size();
       for (size_t i = 0; i < sensors; i++ ) {
         Sensor& sensor = hub.sensor_[i];
-        ch = "_wf" + std::to_string(i + 1) + "=";
+        Ecowitt& event = sensor.ecowitt_;
+
+        // Only encode sensors that changed since the last read
+        if (sensor.generation_ == sensor.generation_read_[FORMAT_ECOWITT]) continue;
+        sensor.generation_read_[FORMAT_ECOWITT] = sensor.generation_;
 
-          event.str("");
+        // Observations received since the last read, capped by the history depth
+        size_t recent = min<uint64_t>(sensor.history_.Pushed() - sensor.history_read_[FORMAT_ECOWITT], sensor.history_.Size());
+        sensor.history_read_[FORMAT_ECOWITT] = sensor.history_.Pushed();
+
+          event.Clear(i + 1);
 
           // Hub attributes (head)
-          event << "PASSKEY=" << hub.id_;
-          event << "&stationtype=" << hub.model_ << "_V" << hub.status_.version << ".0.0";
-          event << "&dateutc=" << Convert::epoch_to_dateutc(hub.status_.timestamp);
+          event.Put(Ecowitt::PASSKEY, hub.id_);
+          event.Put(Ecowitt::STATIONTYPE, hub.model_);
+          event.Append("_V");
+          event.Append(hub.status_.version);
+          event.Append(".0.0");
+          event.Put(Ecowitt::DATEUTC, Ecowitt::Date{hub.status_.timestamp});
 
           // Sensor attributes
-          event << "&batt" << ch << sensor.obs_.battery;
+          event.Put(Ecowitt::BATT, sensor.obs_.battery);
 
         if (sensor.model_ == Sensor::Model::AIR || sensor.model_ == Sensor::Model::TEMPEST) {
           // Temperature, humidity and pressure
-          event << "&tempf" << ch << Convert::C_to_F(sensor.obs_.temperature);
-          event << "&humidity" << ch << sensor.obs_.humidity;
-          event << "&baromrelin" << ch << "0";
-          event << "&baromabsin" << ch << Convert::hPa_to_inHg(sensor.obs_.pressure);
+          event.Put(Ecowitt::TEMPF, Convert::C_to_F(sensor.obs_.temperature));
+          event.Put(Ecowitt::HUMIDITY, sensor.obs_.humidity);
+          event.Put(Ecowitt::BAROMRELIN, 0);
+          event.Put(Ecowitt::BAROMABSIN, Convert::hPa_to_inHg(sensor.obs_.pressure));
+
+          // Interval summary
+          if (recent) {
+            History::Summary temp = sensor.history_.Summarize(History::TEMPERATURE, recent);
+            History::Summary hum = sensor.history_.Summarize(History::HUMIDITY, recent);
+
+            event.Put(Ecowitt::TEMPF_MIN, Convert::C_to_F(temp.min));
+            event.Put(Ecowitt::TEMPF_MAX, Convert::C_to_F(temp.max));
+            event.Put(Ecowitt::TEMPF_AVG, Convert::C_to_F(temp.avg));
+            event.Put(Ecowitt::HUMIDITY_MIN, hum.min);
+            event.Put(Ecowitt::HUMIDITY_MAX, hum.max);
+          }
 
           // Lightning: if we got a strike after the last observation we temporarely increase the count
-          if (sensor.lightning_.timestamp > sensor.obs_.timestamp) sensor.obs_.lightning_count++;
-          event << "&lightning" << ch << sensor.lightning_.distance;
-          event << "&lightning_time" << ch << sensor.lightning_.timestamp;
-          event << "&lightning_energy" << ch << sensor.lightning_.energy;
-          event << "&lightning_num" << ch << sensor.obs_.lightning_count;
+          event.Put(Ecowitt::LIGHTNING, sensor.lightning_.distance);
+          event.Put(Ecowitt::LIGHTNING_TIME, sensor.lightning_.timestamp);
+          event.Put(Ecowitt::LIGHTNING_ENERGY, sensor.lightning_.energy);
+          event.Put(Ecowitt::LIGHTNING_NUM, sensor.obs_.lightning_count + (sensor.lightning_.timestamp > sensor.obs_.timestamp));
         }
 
         if (sensor.model_ == Sensor::Model::SKY || sensor.model_ == Sensor::Model::TEMPEST) {
           // Solar
-          event << "&uv" << ch << sensor.obs_.uv;
-          event << "&solarradiation" << ch << sensor.obs_.solar_radiation;
+          event.Put(Ecowitt::UV, sensor.obs_.uv);
+          event.Put(Ecowitt::SOLARRADIATION, sensor.obs_.solar_radiation);
 
           // Precipitation
-          event << "&rainratein" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_rate);
-          event << "&eventrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_event);
-          event << "&hourlyrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_hourly);
-          event << "&dailyrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_daily);
-          event << "&weeklyrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_weekly);
-          event << "&monthlyrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_monthly);
-          event << "&yearlyrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_yearly);
-          event << "&totalrainin" << ch << Convert::mm_to_in(sensor.obs_stats_.precip_total);
+          event.Put(Ecowitt::RAINRATEIN, Convert::mm_to_in(sensor.obs_stats_.precip_rate));
+          event.Put(Ecowitt::EVENTRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_event));
+          event.Put(Ecowitt::HOURLYRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_hourly));
+          event.Put(Ecowitt::DAILYRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_daily));
+          event.Put(Ecowitt::WEEKLYRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_weekly));
+          event.Put(Ecowitt::MONTHLYRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_monthly));
+          event.Put(Ecowitt::YEARLYRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_yearly));
+          event.Put(Ecowitt::TOTALRAININ, Convert::mm_to_in(sensor.obs_stats_.precip_total));
 
           // Wind
-          event << "&winddir" << ch << sensor.obs_stats_.wind_direction;
-          event << "&winddir_avg10m" << ch << sensor.obs_stats_.wind_direction_avg10m;
-          event << "&windspeedmph" << ch << Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_speed));
-          event << "&windspdmph_avg10m" << ch << Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_speed_avg10m));
-          event << "&windgustmph" << ch << Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_gust));
-          event << "&maxdailygust" << ch << Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_gust_daily));
+          event.Put(Ecowitt::WINDDIR, sensor.obs_stats_.wind_direction);
+          event.Put(Ecowitt::WINDDIR_AVG10M, sensor.obs_stats_.wind_direction_avg10m);
+          event.Put(Ecowitt::WINDSPEEDMPH, Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_speed)));
+          event.Put(Ecowitt::WINDSPDMPH_AVG10M, Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_speed_avg10m)));
+          event.Put(Ecowitt::WINDGUSTMPH, Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_gust)));
+          event.Put(Ecowitt::MAXDAILYGUST, Convert::km_to_mi(Convert::ms_to_kmh(sensor.obs_stats_.wind_gust_daily)));
+
+          // Interval summary
+          if (recent) {
+            History::Summary speed = sensor.history_.Summarize(History::WIND_SPEED, recent);
+            History::Summary gust = sensor.history_.Summarize(History::WIND_GUST, recent);
+
+            event.Put(Ecowitt::WINDSPDMPH_AVG, Convert::km_to_mi(Convert::ms_to_kmh(speed.avg)));
+            event.Put(Ecowitt::WINDGUSTMPH_MAX, Convert::km_to_mi(Convert::ms_to_kmh(gust.max)));
+          }
         }
 
           // Hub attributes (tail)
-          event << "&freq=RSSI" << hub.status_.rssi;
-          event << "&model=" << hub.model_;
+          event.Put(Ecowitt::FREQ, hub.status_.rssi);
+          event.Put(Ecowitt::MODEL, hub.model_);
 
-        if (!(event.str().empty())) data.emplace_back(event.str());
+        if (event.Size()) data.emplace_back(event.View());
       }
     }
 
-    return (data.size());
+    return (data.size() - data_size);
+  }
+
+  size_t ReadWeatherFlow(Log& log, vector<string>& data) {
+    //
+    // Append to data one WeatherFlow REST API observations/station document per hub with changed sensors
+    // and return the number of documents, or 0 if error
+    //
+    size_t data_size = data.size();
+
+    size_t hubs, sensors;
+
+    hubs = hub_.size();
+    for (size_t i = 0; i < hubs; i++ ) {
+      Hub& hub = hub_[i];
+      sensors = hub.sensor_.size();
+
+      // A hub is a station: one observation per sensor, so two sensors of the same model never clash
+      bool changed = false;
+
+      for (size_t i = 0; i < sensors; i++ ) {
+        Sensor& sensor = hub.sensor_[i];
+
+        if (sensor.generation_ != sensor.generation_read_[FORMAT_WEATHERFLOW]) {
+          sensor.generation_read_[FORMAT_WEATHERFLOW] = sensor.generation_;
+          changed = true;
+        }
+      }
+
+      if (!changed) continue;
+
+      JsonWriter& json = weatherflow_;
+
+      json.Clear();
+      json.BeginObject();
+      // No station_id: only the WeatherFlow cloud knows it and a made-up one could match somebody else's station
+      json.Field("station_name", hub.id_);
+      json.Field("public_name", hub.id_);
+
+      json.Key("status").BeginObject();
+      json.Field("status_code", 0);
+      json.Field("status_message", "SUCCESS");
+      json.EndObject();
+
+      json.Key("station_units").BeginObject();
+      json.Field("units_temp", "c");
+      json.Field("units_wind", "mps");
+      json.Field("units_precip", "mm");
+      json.Field("units_pressure", "mb");
+      json.Field("units_distance", "km");
+      json.Field("units_direction", "degrees");
+      json.Field("units_other", "metric");
+      json.EndObject();
+
+      json.Key("obs").BeginArray();
+
+      for (size_t i = 0; i < sensors; i++ ) {
+        const Sensor& sensor = hub.sensor_[i];
+
+        // Sensors that only sent events so far have nothing to report
+        if (!sensor.obs_.timestamp) continue;
+
+        json.BeginObject();
+        json.Field("serial_number", sensor.id_);
+        json.Field("timestamp", sensor.obs_.timestamp);
+
+        if (sensor.model_ == Sensor::Model::AIR || sensor.model_ == Sensor::Model::TEMPEST) {
+          // Temperature, humidity and pressure
+          json.Field("air_temperature", sensor.obs_.temperature);
+          json.Field("station_pressure", sensor.obs_.pressure);
+          json.Field("relative_humidity", sensor.obs_.humidity);
+
+          // Lightning: a strike after the last observation is not counted in it yet
+          json.Field("lightning_strike_count", sensor.obs_.lightning_count + (sensor.lightning_.timestamp > sensor.obs_.timestamp));
+          if (sensor.lightning_.timestamp) {
+            json.Field("lightning_strike_last_epoch", sensor.lightning_.timestamp);
+            json.Field("lightning_strike_last_distance", sensor.lightning_.distance);
+          }
+        }
+
+        if (sensor.model_ == Sensor::Model::SKY || sensor.model_ == Sensor::Model::TEMPEST) {
+          // Solar
+          json.Field("brightness", sensor.obs_.illuminance);
+          json.Field("solar_radiation", sensor.obs_.solar_radiation);
+          json.Field("uv", sensor.obs_.uv);
+
+          // Precipitation
+          json.Field("precip", sensor.obs_.precipitation_accumulation);
+          json.Field("precip_accum_last_1hr", sensor.history_.Total(History::PRECIPITATION, sensor.obs_.timestamp - 3600 + 1));
+          json.Field("precip_accum_local_day", sensor.obs_stats_.precip_daily);
+
+          // Wind
+          json.Field("wind_avg", sensor.obs_.wind_speed);
+          json.Field("wind_direction", sensor.obs_.wind_direction);
+          json.Field("wind_gust", sensor.obs_.wind_gust);
+          json.Field("wind_lull", sensor.obs_.wind_lull);
+        }
+
+        json.EndObject();
+      }
+
+      json.EndArray();
+      json.EndObject();
+
+      data.emplace_back(json.View());
+    }
+
+    return (data.size() - data_size);
+  }
+
+  size_t ReadInflux(Log& log, vector<string>& data) {
+    //
+    // Append to data one InfluxDB line per observation received since the last read (oldest first, capped by the
+    // history depth) and return the number of lines, or 0 if error
+    //
+    size_t data_size = data.size();
+
+    size_t hubs, sensors;
+
+    hubs = hub_.size();
+    for (size_t i = 0; i < hubs; i++ ) {
+      Hub& hub = hub_[i];
+      sensors = hub.sensor_.size();
+      for (size_t i = 0; i < sensors; i++ ) {
+        Sensor& sensor = hub.sensor_[i];
+        const History& history = sensor.history_;
+
+        size_t recent = min<uint64_t>(history.Pushed() - sensor.history_read_[FORMAT_INFLUX], history.Size());
+        sensor.history_read_[FORMAT_INFLUX] = history.Pushed();
+
+        bool air = (sensor.model_ == Sensor::Model::AIR || sensor.model_ == Sensor::Model::TEMPEST);
+        bool sky = (sensor.model_ == Sensor::Model::SKY || sensor.model_ == Sensor::Model::TEMPEST);
+
+        for (size_t age = recent; age--; ) {
+          Influx& line = influx_;
+
+          line.Clear("tempest");
+          line.Tag("hub", hub.id_);
+          line.Tag("sensor", sensor.id_);
+
+          for (int field = 0; field < History::FIELD_MAX; field++) {
+            if (field == History::BATTERY || (air && field <= History::PRESSURE) || (sky && field >= History::ILLUMINANCE && field <= History::WIND_DIRECTION)) {
+              line.Field(History::Name((History::Field)field), history.Value((History::Field)field, age));
+            }
+          }
+
+          line.End(history.Timestamp(age));
+
+          if (line.Fields()) data.emplace_back(line.View());
+        }
+      }
+    }
+
+    return (data.size() - data_size);
   }
 
 private:
 
-  Hub& GetHub(const string& hub_id) {
-    size_t idx;
+  struct Handler {
+    size_t (Tempest::*write)(const UdpMessage& event);         // nullptr: nothing to write
+    bool notify;                                                // wake up the transmitter
+  };
+
+  static const Handler handler_[UDP_EVENT_MAX];                 // see initialization below
 
-    assert(!hub_id.empty());
+  size_t UdpObservationTempest(const UdpMessage& event) { return (GetSensor(event).UdpObservationTempest(event)); }
+  size_t UdpObservationAir(const UdpMessage& event) { return (GetSensor(event).UdpObservationAir(event)); }
+  size_t UdpObservationSky(const UdpMessage& event) { return (GetSensor(event).UdpObservationSky(event)); }
+  size_t UdpWind(const UdpMessage& event) { return (GetSensor(event).UdpWind(event)); }
+  size_t UdpPrecipitation(const UdpMessage& event) { return (GetSensor(event).UdpPrecipitation(event)); }
+  size_t UdpLightning(const UdpMessage& event) { return (GetSensor(event).UdpLightning(event)); }
+  size_t UdpSensorStatus(const UdpMessage& event) { return (GetSensor(event).UdpStatus(event)); }
+  size_t UdpHubStatus(const UdpMessage& event) { return (GetHub(event.serial_number).UdpStatus(event)); }
 
-    for (idx = 0; idx < hub_.size(); idx++) {
-      if (hub_[idx].id_ == hub_id) return (hub_[idx]);
+  inline Sensor& GetSensor(const UdpMessage& event) {
+    Hub& hub = GetHub(event.hub_sn);
+    Sensor& sensor = hub.GetSensor(event.serial_number);
+
+    if (metrics_ && !sensor.metrics_) sensor.metrics_ = metrics_->Add(hub.id_, sensor.id_, MetricsFields(sensor.model_));
+    if (feed_ && !sensor.feed_) sensor.feed_ = feed_->Add(hub.id_, sensor.id_, sensor.model_);
+    if (store_ && !sensor.store_) sensor.store_ = store_->Add(hub.id_, sensor.id_);
+
+    if (state_ && !sensor.restored_) {
+      const StateRecord* record = state_->Find(sensor.id_);
+
+      if (record) sensor.Restore(*record, state_->Saved());
+      sensor.restored_ = true;
     }
 
-    hub_.emplace_back(hub_id, queue_max_);
-    return (hub_[idx]);
+    return (sensor);
+  }
+
+  static uint32_t MetricsFields(Sensor::Model model) {
+    //
+    // History fields each model reports
+    //
+    uint32_t fields = 1 << History::BATTERY;
+
+    if (model == Sensor::Model::AIR || model == Sensor::Model::TEMPEST) {
+      fields |= (1 << History::TEMPERATURE) | (1 << History::HUMIDITY) | (1 << History::PRESSURE);
+    }
+    if (model == Sensor::Model::SKY || model == Sensor::Model::TEMPEST) {
+      for (int field = History::ILLUMINANCE; field <= History::WIND_DIRECTION; field++) fields |= 1 << field;
+    }
+
+    return (fields);
+  }
+
+  Hub& GetHub(string_view hub_id) {
+    assert(!hub_id.empty());
+
+    return (hub_.Get(hub_id, string{hub_id}, queue_max_));
   }
 
   const time_t start_time_;
   const size_t queue_max_;
+  const time_t stale_;                                          // seconds without changes before a sensor is stale
+  Metrics* const metrics_;                                      // shared by every shard, nullptr if not exported
+  Feed* const feed_;                                            // shared by every shard, nullptr if not published
+  const State* const state_;                                    // shared by every shard, nullptr if not restoring
+  Store* const store_;                                          // shared by every shard, nullptr if not storing
+
+  Registry<Hub> hub_;
 
-  vector<Hub> hub_;
+  // Reusable WeatherFlow document and InfluxDB line buffers for the transmitter
+  JsonWriter weatherflow_;
+  Influx influx_;
 
+  atomic<uint64_t> observations_{0};
+
+  // Event Statistics (indexed by UdpEvent): atomic so the metrics exporter can read them without the tempest lock
+  atomic<uint64_t> event_stats_[UDP_EVENT_MAX] = {};
+
+  // Receive Statistics (updated lock-free by the receiver)
   struct {
-    uint debug;
-    uint unknown;
-    uint invalid;
+    atomic<uint64_t> wakeups{0};
+    atomic<uint64_t> datagrams{0};
+    atomic<uint64_t> overflows{0};                              // dropped because the decoder ring was full
   }
-  event_stats_;
+  udp_stats_;
+};
+
+const Tempest::Description Tempest::family_[FAMILY_MAX] = {
+  {"tempest_udp_wakeups_total",      "counter", "Receiver wakeups."},                           // FAMILY_WAKEUPS
+  {"tempest_udp_datagrams_total",    "counter", "UDP datagrams received."},                     // FAMILY_DATAGRAMS
+  {"tempest_udp_overflows_total",    "counter", "UDP datagrams dropped because the decoder ring was full."}, // FAMILY_OVERFLOWS
+  {"tempest_observations_total",     "counter", "Sensor observations decoded."},                // FAMILY_OBSERVATIONS
+  {"tempest_events_total",           "counter", "UDP events decoded by type."}                  // FAMILY_EVENTS
+};
+
+const Tempest::Handler Tempest::handler_[UDP_EVENT_MAX] = {
+  {&Tempest::UdpObservationTempest, false},                     // UDP_OBS_ST
+  {&Tempest::UdpObservationAir,     false},                     // UDP_OBS_AIR
+  {&Tempest::UdpObservationSky,     false},                     // UDP_OBS_SKY
+  {&Tempest::UdpWind,               false},                     // UDP_RAPID_WIND
+  {&Tempest::UdpPrecipitation,      true },                     // UDP_EVT_PRECIP
+  {&Tempest::UdpLightning,          true },                     // UDP_EVT_STRIKE
+  {&Tempest::UdpSensorStatus,       false},                     // UDP_DEVICE_STATUS
+  {&Tempest::UdpHubStatus,          false},                     // UDP_HUB_STATUS
+  {nullptr,                         false},                     // UDP_DEBUG
+  {nullptr,                         false},                     // UDP_UNKNOWN
+  {nullptr,                         false}                      // UDP_INVALID
 };
 
+
 } // namespace tempest
 
 // Recycle Bin -----------------------------------------------------------------------------------------------------------------
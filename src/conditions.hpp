@@ -0,0 +1,205 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: shared memory layout of the conditions feed and its reader, for local consumers
+//
+
+#ifndef TEMPEST_CONDITIONS
+#define TEMPEST_CONDITIONS
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+// Standalone: consumers build it without the relay (no system.hpp, logging or curl)
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "seqlock.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+#define TEMPEST_FEED_NAME       "/tempest_feed"
+#define TEMPEST_FEED_MAGIC      0x54465744                      // "TFWD"
+#define TEMPEST_FEED_VERSION    1                               // bump on any layout change
+
+using namespace std;
+
+//
+// Latest conditions of one sensor: plain fixed-width fields so the layout doesn't depend on the relay internals
+//
+
+struct FeedConditions {
+  int64_t updated;                                              // wall clock of the last change
+
+  struct {
+    int64_t timestamp;
+    int32_t timespan;                                           // minutes
+    int32_t precipitation_type;                                 // 0) none 1) rain 2) hail
+    int32_t lightning_count;
+    int32_t wind_sample;                                        // seconds
+    double battery;                                             // V
+    double temperature;                                         // C
+    double humidity;                                            // %
+    double pressure;                                            // MB
+    double illuminance;                                         // lux
+    double uv;                                                  // index
+    double solar_radiation;                                     // W/m^2
+    double precipitation_accumulation;                          // mm over the time span
+    double lightning_distance;                                  // km
+    double wind_speed;                                          // m/s
+    double wind_lull;                                           // m/s
+    double wind_gust;                                           // m/s
+    double wind_direction;                                      // degrees
+  }
+  obs;
+
+  struct {
+    int64_t timestamp;
+    double speed;                                               // m/s
+    double direction;                                           // degrees
+  }
+  wind;
+
+  struct {
+    int64_t timestamp;
+    double distance;                                            // km
+    double energy;
+  }
+  lightning;
+
+  struct {
+    int64_t timestamp;
+  }
+  precipitation;                                                // rain start
+};
+
+struct FeedRecord {
+  char hub[24];                                                 // written once, before the record is counted
+  char sensor[24];
+  int32_t model;                                                // 0) unknown 1) air 2) sky 3) tempest
+
+  Seqlock<FeedConditions> conditions;                           // single writer: the decoder that owns the sensor
+};
+
+struct FeedData {
+  static constexpr uint32_t SENSOR_MAX = 256;
+
+  atomic<uint32_t> magic;                                       // TEMPEST_FEED_MAGIC once the header is valid
+  uint32_t version;                                             // TEMPEST_FEED_VERSION
+  uint32_t record_size;                                         // sizeof(FeedRecord)
+  uint32_t sensor_max;                                          // SENSOR_MAX
+  atomic<pid_t> pid;                                            // relay publishing, 0 if none
+  atomic<uint32_t> sensors;                                     // records in use, only ever grows
+
+  FeedRecord record[SENSOR_MAX];
+};
+
+//
+// Usage (consumer):
+//
+// #include "conditions.hpp"                                  // with seqlock.hpp: nothing else of the relay
+//
+// FeedReader feed;
+//
+// if (!feed.Initialize()) {                                     // ENOENT: relay not running, EPROTO: other version
+//   for (size_t idx = 0; idx < feed.Sensors(); idx++) {
+//     double temperature;
+//     if (feed.Generation(idx) == last[idx]) continue;          // unchanged since the last poll
+//     feed.Peek(idx, [&](const FeedRecord& record, const FeedConditions& c) { temperature = c.obs.temperature; });
+//   }
+// }
+//
+// Peek() reads in place (no copy) and retries if the relay updated the record meanwhile: only copy values out of
+// the callback, they are consistent once it returns true
+//
+
+class FeedReader {
+public:
+
+  FeedReader() {}
+
+  ~FeedReader() {
+    Deinitialize();
+  }
+
+  error_t Initialize(void) {
+    //
+    // Attach read-only to the feed the relay publishes: return ENOENT if the relay is not running, EPROTO if it's
+    // a different version (the segment size changed) or a system error
+    //
+    error_t err = 0;
+    struct shmid_ds shm;
+    int id;
+    void* addr;
+
+    if (data_) return (EPERM);
+
+    if ((id = shmget(Key(), 0, 0)) == -1) return (errno);
+    if (shmctl(id, IPC_STAT, &shm) == -1) return (errno);
+    if (shm.shm_segsz != sizeof(FeedData)) return (EPROTO);
+    if ((addr = shmat(id, nullptr, SHM_RDONLY)) == (void*)-1) return (errno);
+
+    data_ = (const FeedData*)addr;
+
+    if (data_->magic.load(memory_order_acquire) != TEMPEST_FEED_MAGIC || !data_->pid.load(memory_order_relaxed)) err = ENOENT;
+    else if (data_->version != TEMPEST_FEED_VERSION || data_->record_size != sizeof(FeedRecord) || data_->sensor_max != FeedData::SENSOR_MAX) err = EPROTO;
+
+    if (err) Deinitialize();
+
+    return (err);
+  }
+
+  void Deinitialize(void) {
+    if (data_) shmdt((const void*)data_);
+    data_ = nullptr;
+  }
+
+  static key_t Key(void) {
+    // The System V key the relay creates the segment with (see Ipc::Open())
+    return ((key_t)hash<string>{}(TEMPEST_FEED_NAME));
+  }
+
+  inline bool Running(void) const { return (data_ && data_->pid.load(memory_order_relaxed)); }
+  inline size_t Sensors(void) const { return (data_? data_->sensors.load(memory_order_acquire): 0); }
+  inline const FeedRecord& operator[](size_t idx) const { return (data_->record[idx]); }
+  inline uint32_t Generation(size_t idx) const { return (data_->record[idx].conditions.Generation()); }
+
+  template<typename F>
+  bool Peek(size_t idx, const F& visit) const {
+    const FeedRecord& record = data_->record[idx];
+
+    return (record.conditions.Peek([&](const FeedConditions& conditions) { visit(record, conditions); }));
+  }
+
+  bool Read(size_t idx, FeedConditions& conditions) const {
+    return (data_->record[idx].conditions.Read(conditions));
+  }
+
+private:
+
+  const FeedData* data_ = nullptr;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_CONDITIONS
@@ -0,0 +1,198 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: Unix domain socket control channel with length-prefixed framing
+//
+
+#ifndef TEMPEST_CONTROL
+#define TEMPEST_CONTROL
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+#define TEMPEST_CONTROL_NAME    "tempest_control"               // abstract socket namespace: no file to clean up
+
+using namespace std;
+
+//
+// Frame: <length: uint32 big endian> <code: uint8> <body: length - 1 bytes>
+//
+// Requests carry a Command code and no body. Replies carry 0 or an errno code and the reply text: the pid for STOP,
+// the formatted statistics for STATS, the version for VERSION. After a successful SUBSCRIBE reply the relay sends one
+// frame per decoded event, code 0 and body "<hub>/<sensor>/<type> <json>" (hub status: "<hub>/hub_status <json>"),
+// until either side closes the connection
+//
+// Usage (server):                                Usage (client):
+//
+// string in, out, body;                          Control control;
+// uint8_t code;                                  string reply;
+//
+// in.append(received);                           if (!control.Connect(pid) && !control.Request(Control::STATS, reply)) {
+// while (Control::Parse(in, code, body)) {         cout << reply;
+//   Control::Frame(out, 0, "...");               }
+// }                                              while (!control.Receive(reply)) cout << reply << endl;   // SUBSCRIBE
+//
+
+class Control {
+public:
+
+  enum Command: uint8_t {
+    STOP = 0,
+    STATS = 1,
+    VERSION = 2,
+    SUBSCRIBE = 3
+  };
+
+  static constexpr size_t FRAME_MAX = 16 * 1024 * 1024;         // sanity limit on a frame length
+
+  Control() {}
+
+  ~Control() {
+    if (sock_ != -1) close(sock_);
+  }
+
+  static void Frame(string& out, uint8_t code, string_view body) {
+    uint32_t length = htonl(body.size() + 1);
+
+    out.append((const char*)&length, sizeof(length));
+    out += (char)code;
+    out += body;
+  }
+
+  static bool Parse(string& in, uint8_t& code, string& body) {
+    //
+    // Extract the first complete frame from in: return false if there is none yet
+    // A frame that could never be valid is returned with code EPROTO so the caller can drop the connection
+    //
+    uint32_t length;
+
+    if (in.size() < sizeof(length)) return (false);
+
+    memcpy(&length, in.data(), sizeof(length));
+    length = ntohl(length);
+
+    if (!length || length > FRAME_MAX) {
+      code = EPROTO;
+      body.clear();
+      in.clear();
+      return (true);
+    }
+
+    if (in.size() < sizeof(length) + length) return (false);
+
+    code = (uint8_t)in[sizeof(length)];
+    body.assign(in, sizeof(length) + 1, length - 1);
+    in.erase(0, sizeof(length) + length);
+
+    return (true);
+  }
+
+  static void Address(struct sockaddr_un& addr, socklen_t& len) {
+    // Abstract address: a leading null byte and no terminator
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path + 1, TEMPEST_CONTROL_NAME, sizeof(TEMPEST_CONTROL_NAME) - 1);
+    len = offsetof(struct sockaddr_un, sun_path) + sizeof(TEMPEST_CONTROL_NAME);
+  }
+
+  error_t Connect(pid_t relay) {
+    //
+    // Connect to the relay with the given pid (as published in StatsData::pid): return ECONNREFUSED if it's not
+    // listening, EPERM if someone else is or a system error. The abstract namespace has no file permissions, so any
+    // local user could take the name first and answer in its place
+    //
+    error_t err = 0;
+    struct sockaddr_un addr;
+    socklen_t len;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (relay <= 0) return (ECONNREFUSED);
+
+    Address(addr, len);
+
+    if ((sock_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) return (errno);
+
+    if (connect(sock_, (const struct sockaddr *) &addr, len) == -1) err = errno;
+    else if (getsockopt(sock_, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) err = errno;
+    else if (cred.pid != relay) err = EPERM;
+
+    if (err) {
+      close(sock_);
+      sock_ = -1;
+    }
+
+    return (err);
+  }
+
+  error_t Request(Command cmd, string& reply) {
+    //
+    // Send a command and wait for its reply: return the error code the relay replied with or a system error
+    //
+    string out;
+
+    Frame(out, cmd, "");
+
+    for (size_t sent = 0; sent < out.size(); ) {
+      ssize_t len = send(sock_, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+
+      if (len == -1) {
+        if (errno == EINTR) continue;
+        return (errno);
+      }
+      sent += len;
+    }
+
+    uint8_t code;
+    error_t err = Receive(reply, &code);
+
+    return (err? err: code);
+  }
+
+  error_t Receive(string& body, uint8_t* code = nullptr) {
+    //
+    // Wait for the next frame: return ECONNRESET when the relay closes the connection
+    //
+    uint8_t frame_code;
+    char buffer[4096];
+
+    while (!Parse(in_, frame_code, body)) {
+      ssize_t len = recv(sock_, buffer, sizeof(buffer), 0);
+
+      if (len == -1 && errno == EINTR) continue;
+      if (len == -1) return (errno);
+      if (len == 0) return (ECONNRESET);
+
+      in_.append(buffer, len);
+    }
+
+    if (code) *code = frame_code;
+
+    return (0);
+  }
+
+private:
+
+  int sock_ = -1;
+  string in_;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_CONTROL
@@ -0,0 +1,358 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: preformatted Ecowitt query string encoder
+//
+
+#ifndef TEMPEST_ECOWITT
+#define TEMPEST_ECOWITT
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// Ecowitt ecowitt;
+//
+// ecowitt.Clear(channel);                                       // channel 1..n -> "_wf<n>=" suffix, rebuilt only on change
+// ecowitt.Put(Ecowitt::PASSKEY, hub_id);
+// ecowitt.Put(Ecowitt::DATEUTC, Ecowitt::Date{timestamp});
+// ecowitt.Put(Ecowitt::TEMPF, 72.5);
+// string_view query = ecowitt.View();                           // valid until the next Clear()
+//
+// Numbers are written with to_chars in the same 6 significant digit "%g" format ostream used to produce, so the
+// payload is byte for byte what the Ecowitt driver has always received
+//
+// Json() turns a query string into a flat JSON object for batched destinations: numeric values become numbers,
+// everything else (url decoded) a string
+//
+
+class Ecowitt {
+public:
+
+  enum Key {
+    // Hub (head)
+    PASSKEY = 0,
+    STATIONTYPE,
+    DATEUTC,
+
+    // Sensor
+    BATT,
+    TEMPF,
+    HUMIDITY,
+    BAROMRELIN,
+    BAROMABSIN,
+    TEMPF_MIN,
+    TEMPF_MAX,
+    TEMPF_AVG,
+    HUMIDITY_MIN,
+    HUMIDITY_MAX,
+    LIGHTNING,
+    LIGHTNING_TIME,
+    LIGHTNING_ENERGY,
+    LIGHTNING_NUM,
+    UV,
+    SOLARRADIATION,
+    RAINRATEIN,
+    EVENTRAININ,
+    HOURLYRAININ,
+    DAILYRAININ,
+    WEEKLYRAININ,
+    MONTHLYRAININ,
+    YEARLYRAININ,
+    TOTALRAININ,
+    WINDDIR,
+    WINDDIR_AVG10M,
+    WINDSPEEDMPH,
+    WINDSPDMPH_AVG10M,
+    WINDGUSTMPH,
+    MAXDAILYGUST,
+    WINDSPDMPH_AVG,
+    WINDGUSTMPH_MAX,
+
+    // Hub (tail)
+    FREQ,
+    MODEL,
+
+    KEY_MAX
+  };
+
+  struct Date {
+    time_t epoch;
+  };
+
+  static constexpr int PRECISION = 6;                           // significant digits, as ostream's default
+
+  Ecowitt(void) {
+    buffer_.resize(1024);
+  }
+
+  void Clear(size_t channel = 0) {
+    //
+    // Start a new query string for the given sensor channel
+    //
+    size_ = 0;
+
+    if (channel != channel_) {
+      channel_ = channel;
+      suffix_ = "_wf" + to_string(channel) + "=";
+    }
+  }
+
+  inline string_view View(void) const {
+    return (string_view{buffer_.data(), size_});
+  }
+
+  inline size_t Size(void) const {
+    return (size_);
+  }
+
+  template<typename T>
+  inline void Put(Key key, const T& value) {
+    PutKey(key);
+    Append(value);
+  }
+
+  inline void Append(string_view value) {
+    memcpy(Reserve(value.size()), value.data(), value.size());
+    size_ += value.size();
+  }
+
+  inline void Append(const string& value) {
+    Append(string_view{value});
+  }
+
+  inline void Append(const char* value) {
+    Append(string_view{value});
+  }
+
+  inline void Append(double value) {
+    char* begin = Reserve(NUMBER_MAX);
+    size_ = to_chars(begin, begin + NUMBER_MAX, value, chars_format::general, PRECISION).ptr - buffer_.data();
+  }
+
+  template<typename T, typename enable_if<is_integral<T>::value, int>::type = 0>
+  inline void Append(T value) {
+    char* begin = Reserve(NUMBER_MAX);
+    size_ = to_chars(begin, begin + NUMBER_MAX, value).ptr - buffer_.data();
+  }
+
+  void Append(Date date) {
+    //
+    // "%Y-%m-%d+%H:%M:%S" without gmtime/strftime: the date part is cached since it only changes once a day
+    //
+    time_t day = date.epoch / 86400;
+    time_t second = date.epoch % 86400;
+
+    if (second < 0) {
+      second += 86400;
+      day--;
+    }
+
+    if (day != day_) {
+      day_ = day;
+      CivilDate(day, day_text_);
+    }
+
+    char* text = Reserve(DATE_SIZE);
+
+    memcpy(text, day_text_, 10);
+    text[10] = '+';
+    Digits(text + 11, second / 3600);
+    text[13] = ':';
+    Digits(text + 14, (second / 60) % 60);
+    text[16] = ':';
+    Digits(text + 17, second % 60);
+
+    size_ += DATE_SIZE;
+  }
+
+  static void Json(string_view query, string& json) {
+    //
+    // Append {"key":value,...} for "key=value&..." to json
+    //
+    json += '{';
+
+    for (size_t pos = 0, field = 0; pos < query.size(); field++) {
+      size_t end = query.find('&', pos);
+      if (end == string_view::npos) end = query.size();
+
+      string_view pair = query.substr(pos, end - pos);
+      size_t eq = pair.find('=');
+      string_view key = pair.substr(0, eq);
+      string_view value = (eq == string_view::npos)? string_view{}: pair.substr(eq + 1);
+
+      if (field) json += ',';
+      JsonString(key, json);
+      json += ':';
+
+      double number;
+      from_chars_result res = from_chars(value.data(), value.data() + value.size(), number);
+      if (!value.empty() && res.ec == errc() && res.ptr == value.data() + value.size() && isfinite(number)) json.append(value);
+      else JsonString(value, json);
+
+      pos = end + 1;
+    }
+
+    json += '}';
+  }
+
+private:
+
+  static void JsonString(string_view text, string& json) {
+    //
+    // Url decode text and append it as a quoted JSON string
+    //
+    static const char hex[] = "0123456789abcdef";
+
+    json += '"';
+
+    for (size_t idx = 0; idx < text.size(); idx++) {
+      unsigned char ch = text[idx];
+
+      if (ch == '+') ch = ' ';
+      else if (ch == '%' && idx + 2 < text.size() && isxdigit((unsigned char)text[idx + 1]) && isxdigit((unsigned char)text[idx + 2])) {
+        from_chars(text.data() + idx + 1, text.data() + idx + 3, ch, 16);
+        idx += 2;
+      }
+
+      if (ch == '"' || ch == '\\') {
+        json += '\\';
+        json += ch;
+      }
+      else if (ch < 0x20) {
+        json += "\\u00";
+        json += hex[ch >> 4];
+        json += hex[ch & 0xf];
+      }
+      else json += ch;
+    }
+
+    json += '"';
+  }
+
+  static constexpr size_t NUMBER_MAX = 32;                     // worst case to_chars output for a double or int64
+  static constexpr size_t DATE_SIZE = 19;                      // YYYY-mm-dd+HH:MM:SS
+
+  struct Name {
+    string_view text;
+    bool channel;                                               // followed by the "_wf<n>=" suffix
+  };
+
+  static const Name key_[KEY_MAX];
+
+  inline void PutKey(Key key) {
+    const Name& name = key_[key];
+
+    Append(name.text);
+    if (name.channel) Append(string_view{suffix_});
+  }
+
+  inline char* Reserve(size_t size) {
+    if (size_ + size > buffer_.size()) buffer_.resize(max(buffer_.size() * 2, size_ + size));
+    return (buffer_.data() + size_);
+  }
+
+  static inline void Digits(char* text, time_t value) {
+    text[0] = '0' + value / 10;
+    text[1] = '0' + value % 10;
+  }
+
+  static void CivilDate(time_t days, char text[10]) {
+    //
+    // Days since 1970-01-01 to YYYY-mm-dd (proleptic Gregorian, http://howardhinnant.github.io/date_algorithms.html)
+    //
+    days += 719468;
+    time_t era = (days >= 0? days: days - 146096) / 146097;
+    time_t doe = days - era * 146097;
+    time_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    time_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    time_t mp = (5 * doy + 2) / 153;
+    time_t d = doy - (153 * mp + 2) / 5 + 1;
+    time_t m = mp < 10? mp + 3: mp - 9;
+    time_t y = yoe + era * 400 + (m <= 2);
+
+    y = min<time_t>(max<time_t>(y, 0), 9999);
+
+    text[0] = '0' + y / 1000;
+    text[1] = '0' + (y / 100) % 10;
+    text[2] = '0' + (y / 10) % 10;
+    text[3] = '0' + y % 10;
+    text[4] = '-';
+    Digits(text + 5, m);
+    text[7] = '-';
+    Digits(text + 8, d);
+  }
+
+  vector<char> buffer_;
+  size_t size_ = 0;
+
+  size_t channel_ = 0;
+  string suffix_ = "_wf0=";
+
+  time_t day_ = numeric_limits<time_t>::min();
+  char day_text_[10];
+};
+
+const Ecowitt::Name Ecowitt::key_[Ecowitt::KEY_MAX] = {
+  { "PASSKEY=", false },
+  { "&stationtype=", false },
+  { "&dateutc=", false },
+  { "&batt", true },
+  { "&tempf", true },
+  { "&humidity", true },
+  { "&baromrelin", true },
+  { "&baromabsin", true },
+  { "&tempf_min", true },
+  { "&tempf_max", true },
+  { "&tempf_avg", true },
+  { "&humidity_min", true },
+  { "&humidity_max", true },
+  { "&lightning", true },
+  { "&lightning_time", true },
+  { "&lightning_energy", true },
+  { "&lightning_num", true },
+  { "&uv", true },
+  { "&solarradiation", true },
+  { "&rainratein", true },
+  { "&eventrainin", true },
+  { "&hourlyrainin", true },
+  { "&dailyrainin", true },
+  { "&weeklyrainin", true },
+  { "&monthlyrainin", true },
+  { "&yearlyrainin", true },
+  { "&totalrainin", true },
+  { "&winddir", true },
+  { "&winddir_avg10m", true },
+  { "&windspeedmph", true },
+  { "&windspdmph_avg10m", true },
+  { "&windgustmph", true },
+  { "&maxdailygust", true },
+  { "&windspdmph_avg", true },
+  { "&windgustmph_max", true },
+  { "&freq=RSSI", false },
+  { "&model=", false }
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_ECOWITT
@@ -0,0 +1,104 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: shared memory feed of the latest decoded conditions of every sensor, relay side (see conditions.hpp)
+//
+
+#ifndef TEMPEST_FEED
+#define TEMPEST_FEED
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "ipc.hpp"
+#include "conditions.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage (relay):
+//
+// Feed feed;
+//
+// feed.Initialize();                                            // before the decoders start
+// FeedRecord* record = feed.Add("HB-00013030", "ST-00000512", 3);// once per sensor, any decoder
+// record->conditions.Write([&](FeedConditions& c) { ... });     // every event, from that sensor's decoder only
+//
+// Beyond SENSOR_MAX sensors, or if not initialized, a private record is returned so callers don't need to check
+//
+
+class Feed: public Ipc {
+public:
+
+  Feed(): Ipc() {}
+
+  virtual ~Feed() {
+    if (data_ && data_->pid.load(memory_order_relaxed) == getpid()) data_->pid.store(0, memory_order_release);
+  }
+
+  error_t Initialize(void) {
+    //
+    // Create (or take over) the feed segment and reset it
+    //
+    error_t err;
+
+    if (!(err = Ipc::Initialize(TEMPEST_FEED_NAME, sizeof(FeedData)))) {
+      data_ = (FeedData*)Shared();
+
+      // Readers that attached to a previous relay see an invalid header until the table is reset
+      data_->magic.store(0, memory_order_release);
+      data_->version = TEMPEST_FEED_VERSION;
+      data_->record_size = sizeof(FeedRecord);
+      data_->sensor_max = FeedData::SENSOR_MAX;
+      data_->sensors.store(0, memory_order_relaxed);
+      data_->pid.store(getpid(), memory_order_relaxed);
+      data_->magic.store(TEMPEST_FEED_MAGIC, memory_order_release);
+    }
+
+    return (err);
+  }
+
+  FeedRecord* Add(string_view hub, string_view sensor, int model) {
+    scoped_lock<mutex> lock{access_};
+
+    if (!data_) return (&discard_);
+
+    uint32_t idx = data_->sensors.load(memory_order_relaxed);
+    if (idx == FeedData::SENSOR_MAX) return (&discard_);
+
+    FeedRecord& record = data_->record[idx];
+    Snapshot::Copy(record.hub, sizeof(record.hub), hub);
+    Snapshot::Copy(record.sensor, sizeof(record.sensor), sensor);
+    record.model = model;
+
+    data_->sensors.store(idx + 1, memory_order_release);
+
+    return (&record);
+  }
+
+private:
+
+  mutex access_;                                                // decoders adding sensors concurrently
+  FeedData* data_ = nullptr;
+  FeedRecord discard_;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_FEED
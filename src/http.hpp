@@ -0,0 +1,560 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: asynchronous multi-destination HTTP POST client on the curl multi interface
+//
+
+#ifndef TEMPEST_HTTP
+#define TEMPEST_HTTP
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "log.hpp"
+#include "spool.hpp"
+#include "metrics.hpp"
+#include "snapshot.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage (transmitter thread):
+//
+// Http http{{"http://hubitat.local:39501", "http://192.168.1.10:8080"}};
+//
+// http.Open(log);
+// http.Post(payload);                                           // queued for every destination
+// while (http.Perform(log, 100)) {}                             // drive transfers until all queues are drained
+// http.Close();
+//
+// Snapshot() and Expose() only read atomics and may be called from any thread
+//
+// Each destination keeps up to inflight_max easy handles: they are reused across requests so curl can keep the
+// connection alive, and requests to different destinations proceed concurrently
+//
+// A failed request goes to the destination spool (on disk under <spool>/<url> if a spool directory is given, in
+// memory otherwise) and the destination backs off exponentially with jitter. Once a retry succeeds the spool is
+// drained oldest first, one request at a time, with new payloads queued behind it so ordering is preserved
+//
+
+class Http {
+public:
+
+  Http(const vector<string>& url, const string& spool = "", size_t queue_max = 1024, size_t inflight_max = 4):
+    spool_{spool}, queue_max_{queue_max}, inflight_max_{inflight_max}, random_{random_device{}()} {
+
+    for (const string& destination: url) destination_.emplace_back(new Destination(destination, spool.empty()? "": spool + "/" + SpoolName(destination)));
+  }
+
+  ~Http() {
+    Close();
+  }
+
+  inline size_t Destinations(void) const { return (destination_.size()); }
+
+  void Open(Log& log) {
+    CURLcode res;
+
+    // Initialize CURL library
+    res = curl_global_init(CURL_GLOBAL_ALL);
+    if (res != CURLE_OK) {
+      TLOG_ERROR(log) << "curl_global_init() failed: " << curl_easy_strerror(res) << "." << endl;
+      throw runtime_error("curl_global_init()");
+    }
+    global_ = true;
+
+    // Add slist string
+    for (auto& destination: destination_) {
+      destination->slist_ = curl_slist_append(nullptr, ("Content-Type: " + destination->content_type_).c_str());
+      if (!destination->slist_) {
+        TLOG_ERROR(log) << "curl_slist_append() returned a NULL pointer." << endl;
+        throw runtime_error("curl_slist_append()");
+      }
+    }
+
+    multi_ = curl_multi_init();
+    if (!multi_) {
+      TLOG_ERROR(log) << "curl_multi_init() returned a NULL pointer." << endl;
+      throw runtime_error("curl_multi_init()");
+    }
+
+    // Bound concurrent connections per host: requests beyond that wait in our queue, not in curl's
+    curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, (long)inflight_max_);
+
+    // Undelivered payloads from a previous run are picked up from the spool
+    if (!spool_.empty() && mkdir(spool_.c_str(), 0750) == -1 && errno != EEXIST) {
+      TLOG_ERROR(log) << "mkdir(" << spool_ << ") failed: " << strerror(errno) << "." << endl;
+      throw runtime_error("mkdir()");
+    }
+
+    for (auto& destination: destination_) {
+      destination->spool_.Open(log);
+      UpdateSpoolStats(*destination);
+      if (destination->spool_.Size()) TLOG_INFO(log) << "Spool for " << destination->url_ << ": " << destination->spool_.Size() << " undelivered payloads." << endl;
+    }
+  }
+
+  void Flush(Log& log) {
+    //
+    // Park everything not yet delivered in the spool: on disk it will be retried at the next start
+    //
+    time_t now = time(nullptr);
+
+    for (auto& destination: destination_) {
+      // In the order they were sent, failed or not
+      for (auto& transfer: destination->transfer_) {
+        if (transfer->active && !transfer->spooled) destination->failed_.emplace(transfer->sequence, transfer->payload);
+      }
+      for (auto& [sequence, payload]: destination->failed_) destination->spool_.Push(log, payload, now);
+      destination->failed_.clear();
+      for (const string& payload: destination->queue_) destination->spool_.Push(log, payload, now);
+      destination->queue_.clear();
+    }
+  }
+
+  void Close(void) {
+    for (auto& destination: destination_) {
+      for (auto& transfer: destination->transfer_) {
+        if (transfer->active && multi_) curl_multi_remove_handle(multi_, transfer->curl);
+        curl_easy_cleanup(transfer->curl);
+      }
+      destination->transfer_.clear();
+      destination->idle_.clear();
+      destination->spool_.Close();
+    }
+
+    if (multi_) {
+      curl_multi_cleanup(multi_);
+      multi_ = nullptr;
+    }
+
+    for (auto& destination: destination_) {
+      if (destination->slist_) {
+        curl_slist_free_all(destination->slist_);
+        destination->slist_ = nullptr;
+      }
+    }
+
+    if (global_) {
+      curl_global_cleanup();
+      global_ = false;
+    }
+  }
+
+  inline void SetContentType(size_t idx, const string& content_type) {
+    // Before Open()
+    destination_[idx]->content_type_ = content_type;
+  }
+
+  void Post(const string& payload) {
+    //
+    // Queue payload for every destination
+    //
+    for (size_t idx = 0; idx < destination_.size(); idx++) Post(idx, payload);
+  }
+
+  void Post(size_t idx, const string& payload) {
+    //
+    // Queue payload for destination idx, dropping the oldest if the destination is too far behind
+    //
+    Destination& destination = *destination_[idx];
+
+    if (destination.queue_.size() >= queue_max_) {
+      destination.queue_.pop_front();
+      destination.stats_.dropped++;
+    }
+    destination.queue_.push_back(payload);
+    destination.stats_.queued = destination.queue_.size();
+  }
+
+  size_t Perform(Log& log, int timeout) {
+    //
+    // Start queued requests, wait up to timeout milliseconds for network activity and reap completed transfers
+    // Return the number of requests still queued or in flight
+    //
+    int running;
+    CURLMcode res;
+
+    for (size_t idx = 0; idx < destination_.size(); idx++) Start(log, idx);
+
+    // With nothing to do there is nothing to wait for; while backing off curl_multi_poll() simply sleeps. A transfer can
+    // complete within the first perform and no activity would end the wait: reap it instead
+    res = curl_multi_perform(multi_, &running);
+    if (res == CURLM_OK && Pending() && !Reap(log)) res = curl_multi_poll(multi_, nullptr, 0, timeout, nullptr);
+    if (res == CURLM_OK) res = curl_multi_perform(multi_, &running);
+    if (res != CURLM_OK) {
+      TLOG_ERROR(log) << "curl_multi_perform() failed: " << curl_multi_strerror(res) << "." << endl;
+      throw runtime_error("curl_multi_perform()");
+    }
+
+    Reap(log);
+
+    for (size_t idx = 0; idx < destination_.size(); idx++) Start(log, idx);
+
+    return (Pending());
+  }
+
+  int Retry(void) const {
+    //
+    // Return the milliseconds until the first spooled payload is due to be retried, -1 if none is waiting
+    //
+    auto now = chrono::steady_clock::now();
+    int retry = -1;
+
+    for (auto& destination: destination_) {
+      if (destination->spool_inflight_ || !destination->spool_.Size()) continue;
+
+      int wait = max<int64_t>(0, chrono::duration_cast<chrono::milliseconds>(destination->retry_at_ - now).count() + 1);
+      if (retry < 0 || wait < retry) retry = wait;
+    }
+
+    return (retry);
+  }
+
+  void Wakeup(void) {
+    // Interrupt the wait in Perform() from another thread: the caller serializes this with Open() and Close()
+    if (multi_) curl_multi_wakeup(multi_);
+  }
+
+  void Snapshot(HttpSnapshot& stats) const {
+    //
+    // Fill the fixed-layout statistics --stats prints
+    //
+    stats.destinations = destination_.size();
+    for (size_t idx = 0; idx < destination_.size() && idx < HttpSnapshot::DESTINATION_MAX; idx++) {
+      const Destination& destination = *destination_[idx];
+      const auto& ds = destination.stats_;
+      auto& dst = stats.destination[idx];
+
+      Snapshot::Copy(dst.url, sizeof(dst.url), destination.url_);
+      dst.inflight = ds.inflight;
+      dst.queued = ds.queued;
+      dst.sent = ds.sent;
+      dst.errors = ds.errors;
+      dst.dropped = ds.dropped;
+      dst.latency_sum = ds.latency_sum;
+      dst.latency_max = ds.latency_max;
+      dst.spooled = ds.spooled;
+      dst.spool_oldest = ds.spool_oldest;
+      dst.retry = ds.retry;
+    }
+  }
+
+  void Expose(string& text) const {
+    //
+    // Append the Prometheus families of every destination: like Snapshot() only reads atomics
+    //
+    static const struct {
+      const char* name;
+      const char* type;
+      const char* help;
+      atomic<uint64_t> Counters::* value;
+    }
+    counter[] = {
+      {"tempest_http_inflight", "gauge", "Requests in flight.", &Counters::inflight},
+      {"tempest_http_queued", "gauge", "Payloads waiting for a free transfer.", &Counters::queued},
+      {"tempest_http_spooled", "gauge", "Payloads spooled for retry.", &Counters::spooled},
+      {"tempest_http_sent_total", "counter", "Requests delivered.", &Counters::sent},
+      {"tempest_http_errors_total", "counter", "Requests failed.", &Counters::errors},
+      {"tempest_http_dropped_total", "counter", "Payloads dropped because the queue was full.", &Counters::dropped}
+    };
+
+    for (const auto& family: counter) {
+      Exposition::Family(text, family.name, family.type, family.help);
+      for (const auto& destination: destination_) {
+        Exposition::Sample(text, family.name, Exposition::Label("url", destination->url_), (destination->stats_.*family.value).load(memory_order_relaxed));
+      }
+    }
+
+    Exposition::Family(text, "tempest_http_latency_seconds", "histogram", "Request round trip time.");
+    for (const auto& destination: destination_) {
+      destination->stats_.latency.Expose(text, "tempest_http_latency_seconds", Exposition::Label("url", destination->url_));
+    }
+  }
+
+private:
+
+  struct Counters {
+    atomic<uint64_t> inflight{0};
+    atomic<uint64_t> queued{0};
+    atomic<uint64_t> sent{0};
+    atomic<uint64_t> errors{0};
+    atomic<uint64_t> dropped{0};
+    atomic<uint64_t> latency_sum{0};                            // microseconds
+    atomic<uint64_t> latency_max{0};
+    atomic<uint64_t> spooled{0};
+    atomic<time_t> spool_oldest{0};
+    atomic<time_t> retry{0};                                    // wall clock of the next retry, 0 if healthy
+    Histogram latency;
+  };
+
+  struct Transfer {
+    CURL* curl;
+    size_t destination;
+    string payload;                                             // must outlive the transfer (POSTFIELDS is not copied)
+    bool active;
+    bool spooled;                                               // payload is the spool front (pop on success)
+    uint64_t spool_id;                                          // Spool::FrontId() when sent
+    uint64_t sequence;                                          // order sent, if not spooled
+  };
+
+  struct Destination {
+    Destination(const string& url, const string& spool): url_{url}, spool_{spool} {}
+
+    const string url_;
+    string content_type_ = "application/json";
+    struct curl_slist* slist_ = nullptr;
+
+    Spool spool_;                                               // failed payloads, oldest first
+    bool spool_inflight_ = false;                               // spool front is being retried
+    double backoff_ = 0;                                        // seconds, 0 when healthy
+    chrono::steady_clock::time_point retry_at_;
+    map<uint64_t, string> failed_;                              // by sequence, waiting for the rest to be spooled in order
+    uint64_t sequence_ = 0;
+
+    deque<string> queue_;                                       // waiting for a free transfer
+    vector<unique_ptr<Transfer>> transfer_;                     // up to inflight_max_, reused for keep-alive
+    vector<Transfer*> idle_;
+
+    Counters stats_;
+  };
+
+  Transfer* Acquire(Log& log, size_t idx) {
+    //
+    // Return an idle transfer for destination idx, creating one if below the in-flight limit, or nullptr
+    //
+    Destination& destination = *destination_[idx];
+
+    if (destination.idle_.empty()) {
+      if (destination.transfer_.size() >= inflight_max_) return (nullptr);
+
+      CURL* curl = curl_easy_init();
+      if (!curl) {
+        TLOG_ERROR(log) << "curl_easy_init() returned a NULL pointer." << endl;
+        throw runtime_error("curl_easy_init()");
+      }
+
+      // Verbose
+      // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+
+      // Set the URL that is about to receive our POST
+      curl_easy_setopt(curl, CURLOPT_URL, destination.url_.c_str());
+
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, destination.slist_);
+
+      // Enable location redirects
+      curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+      curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 1L);
+      curl_easy_setopt(curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+
+      // Keep the connection alive between intervals
+      curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+      // Set timeout: a stuck destination must not hold its transfers forever
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+
+      Transfer* transfer = new Transfer{curl, idx, "", false, false, 0, 0};
+      destination.transfer_.emplace_back(transfer);
+      curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+
+      destination.idle_.push_back(transfer);
+    }
+
+    Transfer* transfer = destination.idle_.back();
+    destination.idle_.pop_back();
+
+    return (transfer);
+  }
+
+  void Start(Log& log, size_t idx) {
+    Destination& destination = *destination_[idx];
+    Transfer* transfer;
+
+    if (destination.backoff_ || destination.spool_.Size() || destination.failed_.size()) {
+      // Unhealthy or still catching up: new payloads go behind the spooled ones. Those still in flight were sent before
+      // them and, should they fail too, must be spooled first: until they are done nothing moves
+      if (destination.stats_.inflight > destination.spool_inflight_) return;
+
+      time_t now = time(nullptr);
+
+      for (auto& [sequence, payload]: destination.failed_) destination.spool_.Push(log, payload, now);
+      destination.failed_.clear();
+      for (const string& payload: destination.queue_) destination.spool_.Push(log, payload, now);
+      destination.queue_.clear();
+
+      // Retry/drain the oldest entry, one at a time
+      if (!destination.spool_inflight_ && destination.spool_.Size() && chrono::steady_clock::now() >= destination.retry_at_ && (transfer = Acquire(log, idx))) {
+        destination.spool_.Front(transfer->payload);
+        transfer->spooled = true;
+        transfer->spool_id = destination.spool_.FrontId();
+        destination.spool_inflight_ = true;
+        Add(log, destination, transfer);
+      }
+
+      UpdateSpoolStats(destination);
+    }
+
+    while (!destination.queue_.empty() && (transfer = Acquire(log, idx))) {
+      transfer->payload.swap(destination.queue_.front());
+      destination.queue_.pop_front();
+      transfer->spooled = false;
+      transfer->sequence = destination.sequence_++;
+      Add(log, destination, transfer);
+    }
+
+    destination.stats_.queued = destination.queue_.size();
+  }
+
+  void Add(Log& log, Destination& destination, Transfer* transfer) {
+    // Specify the POST data and its lenght
+    curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDS, transfer->payload.c_str());
+    curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE, (long)transfer->payload.length());
+
+    CURLMcode res = curl_multi_add_handle(multi_, transfer->curl);
+    if (res != CURLM_OK) {
+      TLOG_ERROR(log) << "curl_multi_add_handle() failed: " << curl_multi_strerror(res) << "." << endl;
+      throw runtime_error("curl_multi_add_handle()");
+    }
+
+    transfer->active = true;
+    destination.stats_.inflight++;
+  }
+
+  size_t Pending(void) const {
+    //
+    // Return the number of payloads queued, in flight or spooled
+    //
+    size_t pending = 0;
+
+    for (auto& destination: destination_) pending += destination->queue_.size() + destination->stats_.inflight + destination->failed_.size() + destination->spool_.Size();
+
+    return (pending);
+  }
+
+  void UpdateSpoolStats(Destination& destination) {
+    destination.stats_.spooled = destination.spool_.Size() + destination.failed_.size();
+    destination.stats_.spool_oldest = destination.spool_.Oldest();
+    destination.stats_.retry = destination.backoff_? (time(nullptr) + (time_t)ceil(chrono::duration<double>(destination.retry_at_ - chrono::steady_clock::now()).count())): 0;
+  }
+
+  static string SpoolName(const string& url) {
+    // One spool directory per destination: the url with anything but [A-Za-z0-9.-] replaced by '_'
+    string name = url;
+
+    for (char& ch: name) if (!isalnum((unsigned char)ch) && ch != '.' && ch != '-') ch = '_';
+
+    return (name);
+  }
+
+  size_t Reap(Log& log) {
+    //
+    // Handle the completed transfers and return how many there were
+    //
+    CURLMsg* msg;
+    int left;
+    size_t done = 0;
+
+    while ((msg = curl_multi_info_read(multi_, &left))) {
+      if (msg->msg != CURLMSG_DONE) continue;
+
+      Transfer* transfer;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+
+      Destination& destination = *destination_[transfer->destination];
+      CURLcode res = msg->data.result;
+      long status = 0;
+
+      // A hub that's rebooting or overloaded answers 5xx, 408 or 429: the payload was not taken, so it's retried just
+      // like a transport error. Any other 4xx would be refused again and is dropped
+      if (res == CURLE_OK) curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+      bool retry = (res != CURLE_OK) || status >= 500 || status == 408 || status == 429;
+      bool rejected = !retry && status >= 400;
+
+      if (retry) {
+        // Keep the payload and back off: 1s, 2s, 4s ... 5m, each randomized down to half to spread retries
+        if (transfer->spooled) destination.spool_inflight_ = false;
+        else destination.failed_.emplace(transfer->sequence, transfer->payload);
+
+        destination.backoff_ = min(max(destination.backoff_ * 2, BACKOFF_MIN), BACKOFF_MAX);
+        double delay = uniform_real_distribution<double>{destination.backoff_ / 2, destination.backoff_}(random_);
+        destination.retry_at_ = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(delay));
+
+        TLOG_ERROR(log) << "POST to " << destination.url_ << " failed: " << ((res != CURLE_OK)? curl_easy_strerror(res): "HTTP " + to_string(status)) << ": retrying in " << (int)ceil(delay) << "s (" << destination.spool_.Size() + destination.failed_.size() << " spooled)." << endl;
+        destination.stats_.errors++;
+      }
+      else {
+        curl_off_t total = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_TOTAL_TIME_T, &total);
+
+        if (transfer->spooled) {
+          // Unless it was dropped to make room in the meantime
+          if (destination.spool_.FrontId() == transfer->spool_id) destination.spool_.Pop(log);
+          destination.spool_inflight_ = false;
+        }
+
+        // Any reply that is not retried, a refusal included, means the destination is back: drain the spool right away
+        if (destination.backoff_) {
+          TLOG_INFO(log) << "POST to " << destination.url_ << (rejected? " answered": " succeeded") << ": " << destination.spool_.Size() + destination.failed_.size() << " spooled payloads left." << endl;
+          destination.backoff_ = 0;
+          destination.retry_at_ = chrono::steady_clock::time_point{};
+        }
+
+        if (rejected) {
+          TLOG_ERROR(log) << "POST to " << destination.url_ << " rejected: HTTP " << status << ": payload dropped." << endl;
+          destination.stats_.errors++;
+        }
+        else {
+          destination.stats_.sent++;
+          destination.stats_.latency_sum += total;
+          if ((uint64_t)total > destination.stats_.latency_max) destination.stats_.latency_max = total;
+          destination.stats_.latency.Observe(total / 1e6);
+        }
+      }
+
+      UpdateSpoolStats(destination);
+
+      curl_multi_remove_handle(multi_, transfer->curl);
+      transfer->active = false;
+      destination.stats_.inflight--;
+      destination.idle_.push_back(transfer);
+      done++;
+    }
+
+    return (done);
+  }
+
+  static constexpr double BACKOFF_MIN = 1;                      // seconds
+  static constexpr double BACKOFF_MAX = 300;
+
+  vector<unique_ptr<Destination>> destination_;
+
+  const string spool_;                                          // spool root directory, "" to spool in memory
+
+  CURLM* multi_ = nullptr;
+  bool global_ = false;
+
+  const size_t queue_max_;                                      // max payloads waiting per destination
+  const size_t inflight_max_;                                   // max concurrent requests per destination
+
+  default_random_engine random_;                                // backoff jitter
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_HTTP
@@ -0,0 +1,112 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: InfluxDB line protocol encoder
+// API:         https://docs.influxdata.com/influxdb/v2/reference/syntax/line-protocol/
+//
+
+#ifndef TEMPEST_INFLUX
+#define TEMPEST_INFLUX
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// Influx line;
+//
+// line.Clear("tempest");                                        // measurement
+// line.Tag("hub", hub_id);                                      // tags before fields, keys in lexical order
+// line.Field("temperature", 22.37);                             // non-finite values are skipped
+// line.End(timestamp);                                          // seconds, written in nanoseconds
+// string_view text = line.View();                               // tempest,hub=HB-00013030 temperature=22.37 1588948614000000000
+//
+// Fields are written as floats (no "i" suffix) so a field never changes type when a value happens to be integral
+//
+
+class Influx {
+public:
+
+  Influx(void) {
+    buffer_.reserve(256);
+  }
+
+  inline void Clear(string_view measurement) {
+    buffer_.clear();
+    fields_ = 0;
+    Escape(measurement, false);
+  }
+
+  inline string_view View(void) const { return (buffer_); }
+  inline size_t Size(void) const { return (buffer_.size()); }
+  inline size_t Fields(void) const { return (fields_); }
+
+  inline void Tag(string_view key, string_view value) {
+    buffer_ += ',';
+    Escape(key, true);
+    buffer_ += '=';
+    Escape(value, true);
+  }
+
+  inline void Field(string_view key, double value) {
+    if (!isfinite(value)) return;
+
+    buffer_ += fields_++? ',': ' ';
+    Escape(key, true);
+    buffer_ += '=';
+
+    char text[32];
+    buffer_.append(text, to_chars(text, text + sizeof(text), value).ptr - text);
+  }
+
+  inline void End(time_t timestamp) {
+    char text[24];
+
+    buffer_ += ' ';
+    buffer_.append(text, to_chars(text, text + sizeof(text), (int64_t)timestamp * 1000000000).ptr - text);
+  }
+
+private:
+
+  void Escape(string_view text, bool equal) {
+    //
+    // Commas and spaces are escaped everywhere, equal signs in tag/field keys and tag values; backslashes and control
+    // characters are replaced by '_': serial numbers come from the network and a trailing backslash would escape our
+    // separator while a newline would start a line of its own
+    //
+    for (char ch: text) {
+      if (ch == '\\' || (unsigned char)ch < 0x20 || ch == 0x7f) {
+        buffer_ += '_';
+        continue;
+      }
+      if (ch == ',' || ch == ' ' || (equal && ch == '=')) buffer_ += '\\';
+      buffer_ += ch;
+    }
+  }
+
+  string buffer_;
+  size_t fields_ = 0;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_INFLUX
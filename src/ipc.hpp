@@ -13,6 +13,8 @@
 
 #include "system.hpp"
 
+#include "snapshot.hpp"
+
 // Source ----------------------------------------------------------------------------------------------------------------------
 
 namespace tempest {
@@ -98,6 +100,14 @@ public:
     return (err);
   }
 
+  inline void* Shared(void) const {
+    //
+    // Return the shared memory address without acquiring the semaphore, or nullptr if IPC has not been initialized:
+    // only for data that synchronizes itself (atomics, seqlocks)
+    //
+    return (init_? addr_: nullptr);
+  }
+
 private:
 
   error_t Lock(time_t wait = -1) {
@@ -234,15 +244,18 @@ public:
   enum Command: int {
     NONE = 0,
     STOP = 0,
-    STATS = 1,
-    VERSION = 2  
+    VERSION = 2                                                 // 1 was STATS: read from ServerStats() instead
   };
 
   Rpc(): Ipc() {
     shm_ = nullptr;
   }
 
-  virtual ~Rpc() {}
+  virtual ~Rpc() {
+    // Readers must not mistake a relay that exited for one that's still publishing
+    StatsData* stats = ServerStats();
+    if (stats && stats->pid.load(memory_order_relaxed) == getpid()) stats->pid.store(0, memory_order_release);
+  }
 
   error_t Initialize(void) {
     return (Ipc::Initialize(TEMPEST_IPC_NAME, sizeof(IpcData)));
@@ -296,7 +309,16 @@ public:
     return (err);
   }
 
-  error_t ServerSignals(Relay& relay, const string& version) {
+  StatsData* ServerStats(void) const {
+    //
+    // Return where the relay publishes its statistics, or nullptr if IPC has not been initialized
+    //
+    IpcData* shm = (IpcData*)Shared();
+
+    return (shm? &shm->stats: nullptr);
+  }
+
+  error_t ServerSignals(const string& version) {
     //
     // Relay signal handler
     //
@@ -310,11 +332,6 @@ public:
       if (!(err = Acquire((void*&)shm_))) {
 
         switch (shm_->cmd) {
-        case Command::STATS:
-          CopyStringToShm(relay.Stats());
-          shm_->err = 0;
-          break;
-
         case Command::VERSION:
           CopyStringToShm(version);
           shm_->err = 0;
@@ -362,6 +379,34 @@ public:
     return (err);
   }
 
+  pid_t ClientRelay(void) const {
+    //
+    // Return the pid the relay published, 0 if it's not running or IPC has not been initialized
+    //
+    StatsData* stats = ServerStats();
+
+    return (stats? stats->pid.load(memory_order_acquire): 0);
+  }
+
+  error_t ClientStats(string& msg, pid_t& pid) {
+    //
+    // Snapshot the statistics the relay publishes: no signals, no semaphore, any number of concurrent readers
+    // If the relay is not runnning return ENOENT, EAGAIN if it held a section too long, otherwise the PID of the process
+    //
+    StatsData* stats = ServerStats();
+    msg.clear();
+
+    if (!stats) return (EPERM);
+    if (!(pid = stats->pid.load(memory_order_acquire))) return (ENOENT);
+
+    // A relay that crashed or was killed never cleared its pid: don't print its last numbers as if it were running
+    if (kill(pid, 0) == -1 && errno == ESRCH) return (ENOENT);
+
+    if (!stats->Format(msg)) return (EAGAIN);
+
+    return (0);
+  }
+
   error_t ClientSignals(string& msg) {
     //
     // Client signal handler
@@ -374,10 +419,6 @@ public:
     if (!(err = BlockSignals(&set)) && !(err = sigwait(&set, &sig)) && sig == SIGUSR1 && !(err = Acquire((void*&)shm_))) {
       if (!(err = shm_->err)) {
         switch (shm_->cmd) {
-        case Command::STATS:
-          msg = shm_->buffer; 
-          break;
-
         case Command::VERSION:
           msg = shm_->buffer; 
           break;
@@ -413,7 +454,8 @@ private:
     pid_t cli;
     Command cmd;
     error_t err;
-    char buffer[2048];  
+    char buffer[2048];
+    StatsData stats;                                            // published by the relay, read lock-free
   }* shm_;
 
 };
@@ -15,6 +15,8 @@
 
 #include "system.hpp"
 
+#include "ring.hpp"
+
 // Source ----------------------------------------------------------------------------------------------------------------------
 
 namespace tempest {
@@ -32,6 +34,220 @@ using namespace std;
 //
 // TLOG_WARNING(log)  << "This is a warning" << endl;
 //
+// Log::Start("syslog", &counters);                              // from now on records are queued, not written
+// Log::Stop();                                                  // drain what's left and write synchronously again
+//
+// Once started every Log object (one per thread) stages its formatted records in its own lock-free ring and a
+// background thread drains all of them to syslog, a file or stderr: a burst of records never blocks the thread
+// that logs them. When a ring is full the record is dropped and counted instead
+//
+// Every TLOG_*() call site is rate limited on its own (see LogLimit): a datagram flood that hits the same error
+// can't flood the log, and the next record let through says how many were suppressed meanwhile
+//
+// TLOGF_DEBUG(log, "Datagram of {} bytes: {}", len, text);      // structured record, "{}" for each argument
+// Log::Start("syslog", &counters, "/var/log/tempest.bin");      // structured records to a binary file
+// Log::Decode("/var/log/tempest.bin", cout);                    // ... formatted later, by tempest --decode
+//
+// A structured record only copies its arguments into the ring: the format is registered once per call site and the
+// text is rendered by the background writer, or not at all when records go to the binary file
+//
+// Levels above TEMPEST_LOG_LEVEL (-DTEMPEST_LOG_LEVEL=6 drops debug) are compiled out of TLOG_*() and TLOGF_*()
+//
+
+#ifndef TEMPEST_LOG_LEVEL
+#define TEMPEST_LOG_LEVEL       LOG_DEBUG
+#endif
+
+struct LogFormat {
+  const char* format;                                           // "{}" stands for the next argument
+  const char* file;
+  const char* function;
+  int line;
+  int level;
+};
+
+class LogRecord {
+public:
+
+  //
+  // Binary file: a session header, then the format of each call site the first time one of its records is written,
+  // and the records. Integers are in host byte order, strings are <uint16 length><bytes>
+  //
+  // 'H' <uint32 magic> <uint32 version> <int32 pid>
+  // 'F' <uint32 id> <int32 level> <int32 line> <string file> <string function> <string format>
+  // 'R' <uint32 id> <int32 priority> <int64 time> <string arguments>
+  //
+  // Arguments: <char type> and an int64 (SIGNED), uint64 (UNSIGNED), double (DOUBLE) or string (STRING)
+  //
+
+  static constexpr uint32_t MAGIC = 0x474f4c54;                 // "TLOG"
+  static constexpr uint32_t VERSION = 1;
+
+  enum Type: char {
+    SIGNED = 'i',
+    UNSIGNED = 'u',
+    DOUBLE = 'd',
+    STRING = 's'
+  };
+
+  static uint32_t Register(const LogFormat& format) {
+    //
+    // Return the id of a call site: 1, 2, ... in order of first use, valid for the life of the process
+    //
+    scoped_lock<mutex> lock{access_};
+
+    format_.push_back(&format);
+
+    return (format_.size());
+  }
+
+  static const LogFormat* Format(uint32_t id) {
+    scoped_lock<mutex> lock{access_};
+
+    return ((id && id <= format_.size())? format_[id - 1]: nullptr);
+  }
+
+  template<typename... A>
+  static size_t Encode(char* data, size_t size, const A&... args) {
+    //
+    // Copy the arguments into data and return the bytes used: the ones that don't fit are left out, strings truncated
+    //
+    char* pos = data;
+
+    (Put(pos, data + size, args), ...);
+
+    return (pos - data);
+  }
+
+  static void Text(string& text, const char* format, string_view data) {
+    //
+    // Append format to text with each "{}" replaced by the next argument in data
+    //
+    for (const char* pos = format; *pos; pos++) {
+      if (pos[0] != '{' || pos[1] != '}' || data.empty()) {
+        text += *pos;
+        continue;
+      }
+
+      char type = data[0];
+      char number[32];
+
+      data.remove_prefix(1);
+
+      if (type == STRING && data.size() >= sizeof(uint16_t)) {
+        uint16_t len;
+        memcpy(&len, data.data(), sizeof(len));
+        len = min<size_t>(len, data.size() - sizeof(len));
+        text.append(data.data() + sizeof(len), len);
+        data.remove_prefix(sizeof(len) + len);
+      }
+      else if (data.size() >= sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, data.data(), sizeof(value));
+
+        if (type == SIGNED) text += to_string((int64_t)value);
+        else if (type == UNSIGNED) text += to_string(value);
+        else {
+          double real;
+          memcpy(&real, &value, sizeof(real));
+          snprintf(number, sizeof(number), "%g", real);
+          text += number;
+        }
+
+        data.remove_prefix(sizeof(value));
+      }
+      else data = {};
+
+      pos++;
+    }
+  }
+
+  static void Header(FILE* file) {
+    char kind = 'H';
+    uint32_t magic = MAGIC, version = VERSION;
+    int32_t pid = getpid();
+
+    fwrite(&kind, sizeof(kind), 1, file);
+    fwrite(&magic, sizeof(magic), 1, file);
+    fwrite(&version, sizeof(version), 1, file);
+    fwrite(&pid, sizeof(pid), 1, file);
+  }
+
+  static void Definition(FILE* file, uint32_t id, const LogFormat& format) {
+    char kind = 'F';
+    int32_t level = format.level, line = format.line;
+
+    fwrite(&kind, sizeof(kind), 1, file);
+    fwrite(&id, sizeof(id), 1, file);
+    fwrite(&level, sizeof(level), 1, file);
+    fwrite(&line, sizeof(line), 1, file);
+    String(file, format.file);
+    String(file, format.function);
+    String(file, format.format);
+  }
+
+  static void Record(FILE* file, uint32_t id, int32_t priority, int64_t timestamp, string_view data) {
+    char kind = 'R';
+
+    fwrite(&kind, sizeof(kind), 1, file);
+    fwrite(&id, sizeof(id), 1, file);
+    fwrite(&priority, sizeof(priority), 1, file);
+    fwrite(&timestamp, sizeof(timestamp), 1, file);
+    String(file, data);
+  }
+
+private:
+
+  template<typename T>
+  static void Put(char*& pos, char* end, const T& value) {
+    if constexpr (is_floating_point<T>::value) Scalar(pos, end, DOUBLE, (double)value);
+    else if constexpr (is_enum<T>::value || is_signed<T>::value) Scalar(pos, end, SIGNED, (int64_t)value);
+    else if constexpr (is_integral<T>::value) Scalar(pos, end, UNSIGNED, (uint64_t)value);
+    else {
+      string_view text{value};
+      uint16_t len;
+
+      if (end - pos < (ptrdiff_t)(1 + sizeof(len))) {
+        pos = end;
+        return;
+      }
+
+      len = min<size_t>({text.size(), (size_t)(end - pos) - 1 - sizeof(len), UINT16_MAX});
+
+      *pos++ = STRING;
+      memcpy(pos, &len, sizeof(len));
+      memcpy(pos + sizeof(len), text.data(), len);
+      pos += sizeof(len) + len;
+    }
+  }
+
+  template<typename T>
+  static void Scalar(char*& pos, char* end, Type type, T value) {
+    if (end - pos < (ptrdiff_t)(1 + sizeof(value))) {
+      pos = end;
+      return;
+    }
+
+    *pos++ = type;
+    memcpy(pos, &value, sizeof(value));
+    pos += sizeof(value);
+  }
+
+  static void String(FILE* file, string_view text) {
+    uint16_t len = min<size_t>(text.size(), UINT16_MAX);
+
+    fwrite(&len, sizeof(len), 1, file);
+    fwrite(text.data(), 1, len, file);
+  }
+
+  static mutex access_;
+  static vector<const LogFormat*> format_;                      // by id - 1
+};
+
+struct LogCounters {
+  atomic<uint64_t> records{0};                                  // written by the background thread
+  atomic<uint64_t> dropped{0};                                  // rings full
+};
 
 class Log: public ostream {
 public:
@@ -81,8 +297,347 @@ public:
     return (*this);
   }
 
+  inline void Suppressed(uint64_t count) noexcept {
+    // Noted at the end of the next record
+    buf_.set_suppressed(count);
+  }
+
+  template<typename... A>
+  void Record(uint32_t id, const LogFormat& format, const A&... args) {
+    //
+    // Structured record: see TLOGF()
+    //
+    char data[Sink::SLOT_SIZE - Sink::HEADER_SIZE];
+
+    buf_.record(id, format, string_view{data, LogRecord::Encode(data, sizeof(data), args...)});
+  }
+
+  static bool Start(const string& destination = "syslog", LogCounters* counters = nullptr, const string& binary = "") {
+    //
+    // Start the background writer: destination is "syslog", "stderr" or a file path (appended to); structured
+    // records go to the binary file if any, formatted to destination otherwise
+    // Return false if a file cannot be opened
+    //
+    return (sink_.Start(destination, counters, binary));
+  }
+
+  static void Stop(void) {
+    sink_.Stop();
+  }
+
+  static inline const LogCounters& Counters(void) { return (*sink_.counters_); }
+
+  static error_t Decode(const string& path, ostream& out) {
+    //
+    // Print the structured records of a binary file like the background writer formats them
+    // Return ENOENT if the file can't be read, EPROTO if it isn't a binary log or it's truncated
+    //
+    ifstream file{path, ios::binary};
+    string data{istreambuf_iterator<char>(file), istreambuf_iterator<char>()};
+
+    if (!file) return (ENOENT);
+
+    string_view in{data};
+    map<uint32_t, tuple<int32_t, int32_t, string, string, string>> format;
+    int32_t pid = 0;
+    string text;
+
+    auto get = [&in](auto& value) {
+      if (in.size() < sizeof(value)) return (false);
+      memcpy(&value, in.data(), sizeof(value));
+      in.remove_prefix(sizeof(value));
+      return (true);
+    };
+
+    auto get_string = [&in, &get](string& value) {
+      uint16_t len;
+      if (!get(len) || in.size() < len) return (false);
+      value.assign(in.data(), len);
+      in.remove_prefix(len);
+      return (true);
+    };
+
+    while (!in.empty()) {
+      char kind = in[0];
+      in.remove_prefix(1);
+
+      if (kind == 'H') {
+        uint32_t magic, version;
+
+        if (!get(magic) || !get(version) || !get(pid) || magic != LogRecord::MAGIC || version != LogRecord::VERSION) return (EPROTO);
+
+        // Ids are only valid within a session
+        format.clear();
+      }
+      else if (kind == 'F' && pid) {
+        uint32_t id;
+        int32_t level, line;
+        string file, function, pattern;
+
+        if (!get(id) || !get(level) || !get(line) || !get_string(file) || !get_string(function) || !get_string(pattern)) return (EPROTO);
+        format[id] = {level, line, file, function, pattern};
+      }
+      else if (kind == 'R' && pid) {
+        uint32_t id;
+        int32_t priority;
+        int64_t timestamp;
+        string args;
+
+        if (!get(id) || !get(priority) || !get(timestamp) || !get_string(args)) return (EPROTO);
+
+        auto site = format.find(id);
+        if (site == format.end()) return (EPROTO);
+
+        auto& [level, line, file, function, pattern] = site->second;
+        char stamp[32];
+        time_t time = timestamp;
+        struct tm local;
+
+        text = level_tag_[LOG_PRI(priority)];
+        text += "[" + file + ":" + function + ":" + to_string(line) + "] ";
+        LogRecord::Text(text, pattern.c_str(), args);
+
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&time, &local));
+        out << stamp << " tempest[" << pid << "]: " << text << endl;
+      }
+      else return (EPROTO);
+    }
+
+    return (0);
+  }
+
 private:
 
+  class Sink {
+  public:
+
+    static constexpr size_t RING_SLOTS = 64;                    // records staged per thread
+    static constexpr size_t SLOT_SIZE = 1024;                   // longer records are truncated
+
+    ~Sink() {
+      Stop();
+    }
+
+    static constexpr size_t HEADER_SIZE = sizeof(int) + sizeof(time_t) + sizeof(uint32_t);
+
+    bool Start(const string& destination, LogCounters* counters, const string& binary) {
+      if (started_.load(memory_order_relaxed)) return (true);
+
+      if (destination == "stderr") file_ = stderr;
+      else if (destination != "syslog" && !(file_ = fopen(destination.c_str(), "ae"))) return (false);
+
+      if (!binary.empty()) {
+        if (!(binary_ = fopen(binary.c_str(), "ae"))) {
+          if (file_ && file_ != stderr) fclose(file_);
+          file_ = nullptr;
+          return (false);
+        }
+
+        LogRecord::Header(binary_);
+        defined_.clear();
+      }
+
+      if (counters) counters_ = counters;
+      event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      exit_ = false;
+      thread_ = thread(&Sink::Writer, this);
+
+      started_.store(true, memory_order_release);
+
+      return (true);
+    }
+
+    void Stop(void) {
+      if (!started_.load(memory_order_relaxed)) return;
+
+      // Records logged from now on are written synchronously again
+      started_.store(false, memory_order_release);
+
+      exit_ = true;
+      Signal();
+      thread_.join();
+
+      if (file_ && file_ != stderr) fclose(file_);
+      file_ = nullptr;
+      if (binary_) fclose(binary_);
+      binary_ = nullptr;
+      close(event_);
+      event_ = -1;
+    }
+
+    inline bool Started(void) const { return (started_.load(memory_order_acquire)); }
+
+    shared_ptr<Ring> Register(void) {
+      shared_ptr<Ring> ring = make_shared<Ring>(RING_SLOTS, SLOT_SIZE);
+
+      scoped_lock<mutex> lock{access_};
+      ring_.push_back(ring);
+
+      return (ring);
+    }
+
+    void Push(Ring& ring, int priority, uint32_t id, string_view text) {
+      //
+      // Producer: copy the record (text if id is 0, structured otherwise) into a free slot, or count it as dropped.
+      // Only wake up the writer when the ring was empty: otherwise it's already due to drain it
+      //
+      size_t free = ring.Free();
+
+      if (!free) {
+        counters_->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+      }
+
+      char* slot = ring.SlotFree(0);
+      time_t now = time(nullptr);
+      size_t len = min(text.size(), SLOT_SIZE - HEADER_SIZE);
+
+      memcpy(slot, &priority, sizeof(priority));
+      memcpy(slot + sizeof(priority), &now, sizeof(now));
+      memcpy(slot + sizeof(priority) + sizeof(now), &id, sizeof(id));
+      memcpy(slot + HEADER_SIZE, text.data(), len);
+
+      ring.SetLength(0, HEADER_SIZE + len);
+      ring.Push(1);
+
+      if (free == ring.Capacity()) Signal();
+    }
+
+    LogCounters own_;
+    LogCounters* counters_ = &own_;
+
+  private:
+
+    inline void Signal(void) {
+      uint64_t signal = 1;
+      if (::write(event_, &signal, sizeof(signal)) == -1) {}
+    }
+
+    void Writer(void) {
+      //
+      // Drain every ring, then sleep until woken up or for at most 100ms (a record pushed to a ring that looked busy
+      // a moment ago is picked up at the latest then)
+      //
+      vector<shared_ptr<Ring>> rings;
+      uint64_t dropped = 0;
+      struct pollfd poll_fd = {event_, POLLIN, 0};
+
+      for (;;) {
+        bool exit = exit_;
+
+        {
+          scoped_lock<mutex> lock{access_};
+
+          // Forget the rings of threads that are gone, once drained
+          ring_.erase(remove_if(ring_.begin(), ring_.end(), [](const shared_ptr<Ring>& ring) { return (ring.use_count() == 1 && !ring->Size()); }), ring_.end());
+          rings = ring_;
+        }
+
+        for (auto& ring: rings) {
+          size_t size = ring->Size();
+
+          for (size_t idx = 0; idx < size; idx++) {
+            const char* slot = ring->Slot(idx);
+            int priority;
+            time_t timestamp;
+            uint32_t id;
+
+            memcpy(&priority, slot, sizeof(priority));
+            memcpy(&timestamp, slot + sizeof(priority), sizeof(timestamp));
+            memcpy(&id, slot + sizeof(priority) + sizeof(timestamp), sizeof(id));
+
+            string_view data{slot + HEADER_SIZE, ring->Length(idx) - HEADER_SIZE};
+
+            if (!id) Write(priority, timestamp, data);
+            else WriteRecord(id, priority, timestamp, data);
+          }
+
+          ring->Pop(size);
+          counters_->records.fetch_add(size, memory_order_relaxed);
+        }
+
+        uint64_t total = counters_->dropped.load(memory_order_relaxed);
+        if (total != dropped) {
+          string text{level_tag_[LOG_WARNING]};
+          text += to_string(total - dropped) + " log records dropped: logging faster than they can be written.";
+          Write(LOG_MAKEPRI(LOG_USER, LOG_WARNING), time(nullptr), text);
+          dropped = total;
+        }
+
+        if (file_) fflush(file_);
+        if (binary_) fflush(binary_);
+        rings.clear();
+
+        if (exit) break;
+
+        poll(&poll_fd, 1, 100);
+
+        uint64_t signal;
+        if (read(event_, &signal, sizeof(signal)) == -1) {}
+      }
+    }
+
+    void WriteRecord(uint32_t id, int priority, time_t timestamp, string_view data) {
+      //
+      // Structured record: as it is to the binary file (after its format, the first time), formatted otherwise
+      //
+      const LogFormat* format = LogRecord::Format(id);
+      if (!format) return;
+
+      if (binary_) {
+        if (defined_.size() <= id) defined_.resize(id + 1);
+        if (!defined_[id]) {
+          LogRecord::Definition(binary_, id, *format);
+          defined_[id] = true;
+        }
+
+        LogRecord::Record(binary_, id, priority, timestamp, data);
+        return;
+      }
+
+      text_ = level_tag_[LOG_PRI(priority)];
+      text_ += "[";
+      text_ += format->file;
+      text_ += ":";
+      text_ += format->function;
+      text_ += ":" + to_string(format->line) + "] ";
+      LogRecord::Text(text_, format->format, data);
+
+      Write(priority, timestamp, text_);
+    }
+
+    void Write(int priority, time_t timestamp, string_view text) {
+      if (!file_) {
+        syslog(priority, "%.*s", (int)text.size(), text.data());
+        return;
+      }
+
+      char stamp[32];
+      struct tm local;
+
+      // syslog() drops the trailing newline endl leaves in the buffer, do the same
+      while (!text.empty() && text.back() == '\n') text.remove_suffix(1);
+
+      strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&timestamp, &local));
+      fprintf(file_, "%s tempest[%d]: %.*s\n", stamp, (int)getpid(), (int)text.size(), text.data());
+    }
+
+    atomic<bool> started_{false};
+    atomic<bool> exit_{false};
+    int event_ = -1;
+    thread thread_;
+    FILE* file_ = nullptr;                                      // nullptr: syslog
+    FILE* binary_ = nullptr;                                    // structured records, nullptr: formatted to file_
+    vector<bool> defined_;                                      // by id: format already in binary_
+    string text_;                                               // scratch
+
+    mutex access_;                                              // ring_ (threads registering)
+    vector<shared_ptr<Ring>> ring_;
+  };
+
+  static Sink sink_;
+  static const char* const level_tag_[];                        // see initialization below
+
   class log_buf: public streambuf {
   public:
 
@@ -125,6 +680,24 @@ private:
       level_stream_ = lev;
     }
 
+    inline void set_suppressed(uint64_t count) noexcept {
+      suppressed_ = count;
+    }
+
+    void record(uint32_t id, const LogFormat& format, string_view data) {
+      if (sink_.Started()) {
+        if (!ring_) ring_ = sink_.Register();
+
+        sink_.Push(*ring_, LOG_MAKEPRI(facility_, format.level), id, data);
+      }
+      else {
+        string text;
+
+        LogRecord::Text(text, format.format, data);
+        syslog(LOG_MAKEPRI(facility_, format.level), "%s[%s:%s:%d] %s", level_tag_[format.level], format.file, format.function, format.line, text.c_str());
+      }
+    }
+
   protected:
 
     int_type overflow(int_type c = traits_type::eof()) override {
@@ -136,7 +709,22 @@ private:
 
     int sync(void) override {
       if (buffer_.size()) {
-        syslog(LOG_MAKEPRI(facility_, level_stream_), "%s%s", level_tag_[level_stream_], buffer_.c_str());
+        if (suppressed_) {
+          // Before the trailing newline(s) endl leaves
+          size_t end = buffer_.find_last_not_of('\n') + 1;
+
+          buffer_.insert(end, " (suppressed " + to_string(suppressed_) + " similar messages)");
+          suppressed_ = 0;
+        }
+
+        if (sink_.Started()) {
+          // Stage the record for the background writer
+          if (!ring_) ring_ = sink_.Register();
+
+          buffer_.insert(0, level_tag_[level_stream_]);
+          sink_.Push(*ring_, LOG_MAKEPRI(facility_, level_stream_), 0, buffer_);
+        }
+        else syslog(LOG_MAKEPRI(facility_, level_stream_), "%s%s", level_tag_[level_stream_], buffer_.c_str());
 
         buffer_.clear();
 
@@ -150,17 +738,22 @@ private:
   private:
 
     string buffer_;
+    shared_ptr<Ring> ring_;                                       // staging ring, registered on first use
     Facility facility_;                                           // facility
     Level level_;                                                 // level
     Level level_stream_;                                          // operator << level
     int level_mask_;
-
-    static const char* const level_tag_[];                        // see initialization below
+    uint64_t suppressed_ = 0;                                     // by the rate limit, noted in the next record
   }
   buf_;
 };
 
-const char* const Log::log_buf::level_tag_[] = {
+mutex LogRecord::access_;
+vector<const LogFormat*> LogRecord::format_;
+
+Log::Sink Log::sink_;
+
+const char* const Log::level_tag_[] = {
   "[EMERG]",
   "[ALERT]",
   " [CRIT]",
@@ -184,9 +777,87 @@ static constexpr const char* past_last_slash(const char* const str) {
   return (last_slash);
 }
 
+//
+// Token bucket rate limit of one log call site, shared by all the threads that reach it
+//
+// Usage:
+//
+// static LogLimit limit{__FILENAME__, __func__, __LINE__};
+//
+// if (limit.Allow(log, Log::Level::error)) log << "..." << endl; // TLOG_*() do this for every call site
+//
+// Allow() also starts the record with its level and the "[file:function:line] " prefix, built once per call site
+//
+// Up to BURST records go through back to back, then one every PERIOD_MS. While the bucket is empty a record costs
+// an atomic load and a coarse clock read (vDSO, no system call) before it's dropped: it is never formatted
+//
+
+class LogLimit {
+public:
+
+  static constexpr int32_t BURST = 10;
+  static constexpr int64_t PERIOD_MS = 6000;                    // 10 records per minute sustained
+
+  LogLimit(const char* file, const char* function, int line) {
+    where_ = "[";
+    where_ += file;
+    where_ += ":";
+    where_ += function;
+    where_ += ":" + to_string(line) + "] ";
+  }
+
+  inline bool Allow(Log& log, Log::Level level) noexcept {
+    if ((tokens_.load(memory_order_relaxed) > 0 || Refill()) && tokens_.fetch_sub(1, memory_order_relaxed) > 0) {
+      uint64_t suppressed = suppressed_.load(memory_order_relaxed);
+
+      if (suppressed) log.Suppressed(suppressed_.exchange(0, memory_order_relaxed));
+      log << level << where_;
+
+      return (true);
+    }
+
+    suppressed_.fetch_add(1, memory_order_relaxed);
+
+    return (false);
+  }
+
+private:
+
+  bool Refill(void) noexcept {
+    //
+    // Add the tokens earned since the last refill: only one of the threads racing for it does
+    //
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    int64_t due = refill_.load(memory_order_relaxed);
+
+    if (!due) {
+      // First time the burst runs out: the first token is due a period from now
+      refill_.compare_exchange_strong(due, now + PERIOD_MS, memory_order_relaxed);
+      return (false);
+    }
+
+    if (now < due || !refill_.compare_exchange_strong(due, now + PERIOD_MS, memory_order_relaxed)) return (false);
+
+    int64_t earned = min<int64_t>(BURST, (now - due) / PERIOD_MS + 1);
+
+    // Losers of fetch_sub() may have left it negative
+    tokens_.store(min<int64_t>(BURST, max(tokens_.load(memory_order_relaxed), 0) + earned), memory_order_relaxed);
+
+    return (true);
+  }
+
+  atomic<int32_t> tokens_{BURST};
+  atomic<int64_t> refill_{0};                                   // steady ms at which the next token is due
+  atomic<uint64_t> suppressed_{0};                              // since the last record let through
+  string where_;                                                // "[file:function:line] "
+};
+
 #define __FILENAME__            ({constexpr const char* const sf__ {past_last_slash(__FILE__)}; sf__;})
 
-#define TLOG(OBJ, LEVEL)        (OBJ.IsLevelEnabled(LEVEL)) && (OBJ << LEVEL << "[" << __FILENAME__ << ":" << __func__ << ":" << __LINE__ << "] ")
+#define TLOG(OBJ, LEVEL)        ((LEVEL) <= TEMPEST_LOG_LEVEL) && (OBJ.IsLevelEnabled(LEVEL)) && ({static LogLimit limit__{__FILENAME__, __func__, __LINE__}; limit__.Allow(OBJ, LEVEL);}) && (OBJ)
 
 #define TLOG_EMERG(OBJ)         TLOG(OBJ, Log::Level::emergency)
 #define TLOG_ALERT(OBJ)         TLOG(OBJ, Log::Level::alert)
@@ -197,6 +868,13 @@ static constexpr const char* past_last_slash(const char* const str) {
 #define TLOG_INFO(OBJ)          TLOG(OBJ, Log::Level::info)
 #define TLOG_DEBUG(OBJ)         TLOG(OBJ, Log::Level::debug)
 
+#define TLOGF(OBJ, LEVEL, FORMAT, ...) ((LEVEL) <= TEMPEST_LOG_LEVEL) && (OBJ.IsLevelEnabled(LEVEL)) && ({static const LogFormat format__{FORMAT, __FILENAME__, __func__, __LINE__, LEVEL}; static const uint32_t id__ = LogRecord::Register(format__); OBJ.Record(id__, format__, ##__VA_ARGS__); true;})
+
+#define TLOGF_ERROR(OBJ, ...)   TLOGF(OBJ, Log::Level::error, __VA_ARGS__)
+#define TLOGF_WARNING(OBJ, ...) TLOGF(OBJ, Log::Level::warning, __VA_ARGS__)
+#define TLOGF_INFO(OBJ, ...)    TLOGF(OBJ, Log::Level::info, __VA_ARGS__)
+#define TLOGF_DEBUG(OBJ, ...)   TLOGF(OBJ, Log::Level::debug, __VA_ARGS__)
+
 } // namespace tempest
 
 // Recycle Bin ----------------------------------------------------------------------------------------------------------------
@@ -35,7 +35,22 @@
 #include "log.hpp"
 #include "args.hpp"
 #include "convert.hpp"
+#include "snapshot.hpp"
 #include "ipc.hpp"
+#include "feed.hpp"
+#include "state.hpp"
+#include "store.hpp"
+#include "control.hpp"
+#include "ring.hpp"
+#include "spool.hpp"
+#include "http.hpp"
+#include "mqtt.hpp"
+#include "udp.hpp"
+#include "registry.hpp"
+#include "ecowitt.hpp"
+#include "writer.hpp"
+#include "influx.hpp"
+#include "metrics.hpp"
 #include "codec.hpp"
 #include "relay.hpp"
 
@@ -62,7 +77,7 @@ int main(int argc, char* const argv[]) {
   Log log{facility, level};
 
   try {
-    string text;
+    string text, path;
 
     // Print command line
     Arguments::PrintCommandLine(argc, argv, text);
@@ -74,7 +89,7 @@ int main(int argc, char* const argv[]) {
       //
 
       // Log and print error
-      text = "Invalid command line.";
+      text = args.GetError().empty()? "Invalid command line.": "Invalid command line: " + args.GetError() + ".";
       TLOG_ERROR(log) << text << endl;
       cerr << text << endl;
 
@@ -85,7 +100,7 @@ int main(int argc, char* const argv[]) {
       throw invalid_argument("command line");
     }
 
-    string url;
+    vector<string> url;
     int interval;
 
     if (args.IsCommandRelay(url, interval, text) || args.IsCommandTrace(interval, text)) {
@@ -117,18 +132,46 @@ int main(int argc, char* const argv[]) {
       //
       // Start relay
       // 
-      Relay relay{url, interval, facility, level};
+      Relay relay{url, interval, facility, level, args.GetReceivers(), args.GetStale(), args.GetSpool(), args.GetBatch(), args.GetFormat(), args.GetMqtt(), args.GetQos(), args.GetMetrics()};
+
+      // Publish statistics for --stats
+      relay.Share(ipc.ServerStats());
+
+      // From now on records are written by a background thread
+      if (!Log::Start(args.GetLogTo(), ipc.ServerStats()? &ipc.ServerStats()->log: nullptr, args.GetLogBin())) {
+        oss << "Error opening log " << args.GetLogTo() << (args.GetLogBin().empty()? "": " or ") << args.GetLogBin() << ": " << strerror(errno) << "." << endl;
+        TLOG_ERROR(log) << oss.str();
+        cerr << oss.str();
+        throw runtime_error("Log::Start()");
+      }
+
+      // Resume the accumulations of the previous run
+      if (!args.GetState().empty()) relay.Restore(args.GetState());
+
+      // Keep the observations
+      if (!args.GetStore().empty()) relay.OpenStore(args.GetStore());
 
       // Worker thread should not receive signals
       ipc.BlockSignals();
 
-      future<int> rx = async(launch::async, &Relay::Receiver, &relay);
+      vector<future<int>> rx;
+      for (size_t shard = 0; shard < relay.Receivers(); shard++) {
+        rx.push_back(async(launch::async, &Relay::Decoder, &relay, shard));
+        rx.push_back(async(launch::async, &Relay::Receiver, &relay, shard));
+      }
       future<int> tx = async(launch::async, &Relay::Transmitter, &relay);
+      future<int> pub;
+      if (relay.Publishing()) pub = async(launch::async, &Relay::Publisher, &relay);
+      future<int> met;
+      if (relay.Exporting()) met = async(launch::async, &Relay::Exporter, &relay);
+      future<int> ctl = async(launch::async, &Relay::Controller, &relay, string{TEMPEST_VERSION});
+      future<int> sav;
+      if (relay.Saving()) sav = async(launch::async, &Relay::Saver, &relay);
 
       //
       // Handle signals
       //
-      if (err = ipc.ServerSignals(relay, TEMPEST_VERSION)) {
+      if (err = ipc.ServerSignals(TEMPEST_VERSION)) {
         oss << "Error handling IPC: " << strerror(err) << "." << endl;
         TLOG_ERROR(log) << oss.str();
         cerr << oss.str();
@@ -136,18 +179,41 @@ int main(int argc, char* const argv[]) {
 
       relay.Stop();
 
-      int err_rx = rx.get();
+      int err_rx = 0;
+      for (auto& rx_shard: rx) {
+        int err_shard = rx_shard.get();
+        if (!err_rx) err_rx = err_shard;
+      }
       int err_tx = tx.get();
-      if (!err) err = err_rx? err_rx: err_tx;
+      int err_pub = pub.valid()? pub.get(): 0;
+      int err_met = met.valid()? met.get(): 0;
+      int err_ctl = ctl.get();
+      int err_sav = sav.valid()? sav.get(): 0;
+      if (!err) err = err_rx? err_rx: err_tx? err_tx: err_pub? err_pub: err_met? err_met: err_ctl? err_ctl: err_sav;
+
+      // Everything decoded is in: save the accumulations one last time
+      relay.Save();
+      relay.CloseStore();
+
+      // Write what's still queued, synchronously from now on
+      Log::Stop();
     }
     else if (args.IsCommandStop(text)) {
       //
       // Stop tempest relay
       //
-      pid_t pid; 
+      pid_t pid = -1;
       ostringstream oss;
+      Control control;
+      error_t init = ipc.Initialize();
 
-      if ((err = ipc.Initialize()) || (err = ipc.ClientCommand(Rpc::Command::STOP, pid))) {
+      // Control channel first, signals if the relay doesn't listen on it or someone else does
+      if (!control.Connect(ipc.ClientRelay())) {
+        if (!(err = control.Request(Control::STOP, text))) pid = stoi(text);
+      }
+      else if ((err = init) || (err = ipc.ClientCommand(Rpc::Command::STOP, pid))) {}
+
+      if (err) {
         if (err == ENOENT) oss << argv[0] << " not running." << endl;
         else oss << "Error stopping " << argv[0] << "(" << pid << "): " << strerror(err) << "." << endl;
         TLOG_ERROR(log) << oss.str();
@@ -166,18 +232,14 @@ int main(int argc, char* const argv[]) {
       pid_t pid;
       ostringstream oss;
 
-      if ((err = ipc.Initialize()) || (err = ipc.ClientCommand(Rpc::Command::STATS, pid))) {      
+      pid = -1;
+      if ((err = ipc.Initialize()) || (err = ipc.ClientStats(text, pid))) {
         if (err == ENOENT) oss << argv[0] << " not running." << endl;
         else oss << "Error getting stats from " << argv[0] << "(" << pid << "): " << strerror(err) << "." << endl;
         TLOG_ERROR(log) << oss.str();
         cerr << oss.str();
       }
-      else if (err = ipc.ClientSignals(text)) {
-        oss << "Error handling IPC: " << strerror(err) << "." << endl;
-        TLOG_ERROR(log) << oss.str();
-        cerr << oss.str();
-      }
-      else {        
+      else {
         cout << text;
       }
     }
@@ -187,10 +249,75 @@ int main(int argc, char* const argv[]) {
       //
       pid_t pid;
 
+      Control control;
+      error_t init = ipc.Initialize();
+
       cout << TEMPEST_VERSION;
-      if (!ipc.Initialize() && !ipc.ClientCommand(Rpc::Command::VERSION, pid) && !ipc.ClientSignals(text)) cout << " (running: " << text << ")";
+      if (!control.Connect(ipc.ClientRelay())) {
+        if (!control.Request(Control::VERSION, text)) cout << " (running: " << text << ")";
+      }
+      else if (!init && !ipc.ClientCommand(Rpc::Command::VERSION, pid) && !ipc.ClientSignals(text)) cout << " (running: " << text << ")";
       cout << endl;
     }
+    else if (args.IsCommandSubscribe(text)) {
+      //
+      // Print every decoded event until the relay exits
+      //
+      ostringstream oss;
+      Control control;
+
+      ipc.Initialize();
+
+      if ((err = control.Connect(ipc.ClientRelay())) || (err = control.Request(Control::SUBSCRIBE, text))) {
+        if (err == ECONNREFUSED) oss << argv[0] << " not running." << endl;
+        else oss << "Error subscribing to " << argv[0] << ": " << strerror(err) << "." << endl;
+        TLOG_ERROR(log) << oss.str();
+        cerr << oss.str();
+      }
+      else {
+        while (!control.Receive(text)) cout << text << endl;
+      }
+    }
+    else if (args.IsCommandDecode(path, text)) {
+      //
+      // Print the observations of a store segment or the structured records of a binary log
+      //
+      ostringstream oss;
+      StoreReader reader;
+
+      if (!(err = reader.Open(path))) {
+        const StoreHeader& header = reader.Header();
+
+        cout << "timestamp," << string{header.names, strnlen(header.names, sizeof(header.names))} << endl;
+        cout << setprecision(15);
+
+        err = reader.Read([&header](int64_t timestamp, const double* value) {
+          cout << timestamp;
+          for (uint32_t field = 0; field < header.fields; field++) {
+            cout << ',';
+            if (!isnan(value[field])) cout << value[field];
+          }
+          cout << '\n';
+        });
+
+        if (err) {
+          oss << path << " is corrupted." << endl;
+          TLOG_ERROR(log) << oss.str();
+          cerr << oss.str();
+        }
+      }
+      else if (err != EPROTO) {
+        oss << "Error reading " << path << ": " << strerror(err) << "." << endl;
+        TLOG_ERROR(log) << oss.str();
+        cerr << oss.str();
+      }
+      else if (err = Log::Decode(path, cout)) {
+        if (err == EPROTO) oss << path << " is not a store segment or a binary log, or it's truncated." << endl;
+        else oss << "Error reading " << path << ": " << strerror(err) << "." << endl;
+        TLOG_ERROR(log) << oss.str();
+        cerr << oss.str();
+      }
+    }
     else if (args.IsCommandHelp(text)) {
       //
       // Help
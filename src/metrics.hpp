@@ -0,0 +1,218 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: lock-free metrics and Prometheus text exposition
+// API:         https://prometheus.io/docs/instrumenting/exposition_formats/
+//
+
+#ifndef TEMPEST_METRICS
+#define TEMPEST_METRICS
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// Exposition::Family(text, "tempest_datagrams_total", "counter", "UDP datagrams received.");
+// Exposition::Sample(text, "tempest_datagrams_total", Exposition::Label("receiver", "0"), datagrams);
+//
+
+class Exposition {
+public:
+
+  static void Family(string& text, string_view name, string_view type, string_view help) {
+    text += "# HELP ";
+    text += name;
+    text += ' ';
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += ' ';
+    text += type;
+    text += '\n';
+  }
+
+  static void Sample(string& text, string_view name, string_view labels, double value) {
+    char number[32];
+
+    text += name;
+    if (!labels.empty()) {
+      text += '{';
+      text += labels;
+      text += '}';
+    }
+    text += ' ';
+    if (isnan(value)) text += "NaN";
+    else if (isinf(value)) text += (value > 0)? "+Inf": "-Inf";
+    else text.append(number, to_chars(number, number + sizeof(number), value).ptr - number);
+    text += '\n';
+  }
+
+  static string Label(string_view name, string_view value) {
+    //
+    // name="value" with backslash, quote and newline escaped
+    //
+    string label{name};
+
+    label += "=\"";
+    for (char ch: value) {
+      if (ch == '\\' || ch == '"') label += '\\';
+      if (ch == '\n') label += "\\n";
+      else label += ch;
+    }
+    label += '"';
+
+    return (label);
+  }
+};
+
+//
+// Usage:
+//
+// Histogram latency;
+//
+// latency.Observe(0.0042);                                      // seconds, any thread
+// latency.Expose(text, "tempest_receive_latency_seconds", "");  // cumulative _bucket/_sum/_count samples
+//
+// Buckets are fixed and log spaced from 100us to 10s: Observe() is a short scan and two relaxed atomic adds
+//
+
+class Histogram {
+public:
+
+  static constexpr size_t BUCKET_MAX = 16;
+
+  void Observe(double seconds) {
+    size_t bucket = 0;
+
+    while (bucket < BUCKET_MAX && seconds > bound_[bucket]) bucket++;
+
+    count_[bucket].fetch_add(1, memory_order_relaxed);
+    sum_.fetch_add((uint64_t)(max(seconds, 0.0) * 1e6), memory_order_relaxed);
+  }
+
+  void Expose(string& text, string_view name, string_view labels) const {
+    uint64_t count = 0;
+    char number[32];
+
+    for (size_t bucket = 0; bucket <= BUCKET_MAX; bucket++) {
+      count += count_[bucket].load(memory_order_relaxed);
+
+      text += name;
+      text += "_bucket{";
+      if (!labels.empty()) {
+        text += labels;
+        text += ',';
+      }
+      text += "le=\"";
+      if (bucket < BUCKET_MAX) text.append(number, to_chars(number, number + sizeof(number), bound_[bucket]).ptr - number);
+      else text += "+Inf";
+      text += "\"} ";
+      text += to_string(count);
+      text += '\n';
+    }
+
+    Exposition::Sample(text, string{name} + "_sum", labels, sum_.load(memory_order_relaxed) / 1e6);
+    Exposition::Sample(text, string{name} + "_count", labels, (double)count);
+  }
+
+private:
+
+  static constexpr double bound_[BUCKET_MAX] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+  atomic<uint64_t> count_[BUCKET_MAX + 1] = {};                 // last one is +Inf
+  atomic<uint64_t> sum_{0};                                     // microseconds
+};
+
+//
+// Usage:
+//
+// Metrics metrics;
+//
+// Metrics::Sensor* slot = metrics.Add(hub_id, sensor_id, fields); // decoder, once per sensor
+// slot->Update(timestamp, value, size);                         // decoder, every observation
+//
+// for (size_t idx = 0; idx < metrics.Sensors(); idx++) metrics[idx]; // any thread, no lock
+//
+// Slots are preallocated and published by a release store of the count, so readers never see a slot being added.
+// Beyond SENSOR_MAX sensors a shared, never exposed slot is returned so callers don't need to check
+//
+
+class Metrics {
+public:
+
+  static constexpr size_t SENSOR_MAX = 256;
+  static constexpr size_t VALUE_MAX = 16;
+
+  struct Sensor {
+    char hub[24];
+    char id[24];
+    uint32_t fields;                                            // bitmask of the values that apply to this sensor
+
+    atomic<int64_t> timestamp{0};
+    atomic<double> value[VALUE_MAX] = {};
+
+    void Update(time_t time, const double* values, size_t size) {
+      for (size_t idx = 0; idx < size && idx < VALUE_MAX; idx++) value[idx].store(values[idx], memory_order_relaxed);
+      timestamp.store(time, memory_order_release);
+    }
+  };
+
+  Sensor* Add(string_view hub, string_view id, uint32_t fields) {
+    scoped_lock<mutex> lock{access_};
+
+    size_t idx = sensors_.load(memory_order_relaxed);
+    if (idx == SENSOR_MAX) return (&discard_);
+
+    Sensor& sensor = sensor_[idx];
+    Copy(sensor.hub, hub);
+    Copy(sensor.id, id);
+    sensor.fields = fields;
+
+    sensors_.store(idx + 1, memory_order_release);
+
+    return (&sensor);
+  }
+
+  inline size_t Sensors(void) const { return (sensors_.load(memory_order_acquire)); }
+  inline const Sensor& operator[](size_t idx) const { return (sensor_[idx]); }
+
+  Histogram receive_;                                           // datagram received -> decoded
+
+private:
+
+  static void Copy(char* text, string_view value) {
+    size_t size = min(value.size(), sizeof(Sensor::hub) - 1);
+
+    memcpy(text, value.data(), size);
+    text[size] = '\0';
+  }
+
+  mutex access_;                                                // writers only
+  atomic<size_t> sensors_{0};
+  Sensor sensor_[SENSOR_MAX];
+  Sensor discard_;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_METRICS
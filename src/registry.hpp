@@ -0,0 +1,108 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: hash-indexed registry of hubs and sensors with pointer-stable storage
+//
+
+#ifndef TEMPEST_REGISTRY
+#define TEMPEST_REGISTRY
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+class Serial {
+public:
+
+  static uint64_t Id(string_view serial) {
+    //
+    // Compact a WeatherFlow serial number into an integer: "HB-00013030" -> 'H' << 56 | 'B' << 48 | 13030
+    // Serial numbers not in the <AA>-<digits> format are hashed instead, with the top bit set so the two never collide.
+    // Still not one to one ("HB-013030" and hashes can clash): use it to index, not to identify
+    //
+    uint64_t number = 0;
+
+    if (serial.size() > 3 && serial.size() <= 3 + 14 && serial[2] == '-' && (serial[0] & 0x80) == 0) {
+      const char* begin = serial.data() + 3;
+      const char* end = serial.data() + serial.size();
+
+      from_chars_result res = from_chars(begin, end, number);
+      if (res.ec == errc() && res.ptr == end) {
+        return (((uint64_t)serial[0] << 56) | ((uint64_t)(uint8_t)serial[1] << 48) | number);
+      }
+    }
+
+    return (hash<string_view>{}(serial) | (1ULL << 63));
+  }
+};
+
+//
+// Usage:
+//
+// Registry<Hub> hub;
+//
+// Hub& h = hub.Get(serial, serial, queue_max);                 // find or construct in place
+// for (size_t idx = 0; idx < hub.size(); idx++) hub[idx];      // insertion order
+//
+// References returned by Get() and operator[] stay valid for the lifetime of the registry
+//
+
+template<typename T>
+class Registry {
+public:
+
+  inline size_t size(void) const { return (item_.size()); }
+
+  inline T& operator[](size_t idx) { return (item_[idx]); }
+  inline const T& operator[](size_t idx) const { return (item_[idx]); }
+
+  T* Find(string_view serial) const {
+    auto [begin, end] = index_.equal_range(Serial::Id(serial));
+
+    for (auto it = begin; it != end; it++) if (it->second.first == serial) return (it->second.second);
+
+    return (nullptr);
+  }
+
+  template<typename... Args>
+  T& Get(string_view serial, Args&&... args) {
+    //
+    // Return the item with the given serial number, constructing it from args if not found
+    //
+    T* item = Find(serial);
+
+    if (!item) {
+      // deque never relocates existing elements when growing at the end
+      item = &item_.emplace_back(forward<Args>(args)...);
+      index_.emplace(Serial::Id(serial), pair<string, T*>{serial, item});
+    }
+
+    return (*item);
+  }
+
+private:
+
+  deque<T> item_;                                               // pointer-stable storage
+  unordered_multimap<uint64_t, pair<string, T*>> index_;        // serial id -> serial, item
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_REGISTRY
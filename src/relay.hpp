@@ -15,6 +15,11 @@
 #include "system.hpp"
 
 #include "log.hpp"
+#include "ring.hpp"
+#include "http.hpp"
+#include "mqtt.hpp"
+#include "feed.hpp"
+#include "control.hpp"
 #include "codec.hpp"
 
 // Source ---------------------------------------------------------------------------------------------------------------------
@@ -23,17 +28,72 @@ namespace tempest {
 
 using namespace std;
 
-class Relay: Tempest {
+class Relay {
 public:
 
-  Relay(const string& url, int interval, Log::Facility facility, Log::Level level, int port = 50222, int buffer_max = 1024, int queue_max = 128, int io_timeout = 1):
-    Tempest(queue_max), url_{url}, interval_{interval * 60}, facility_{facility}, level_{level}, port_{port}, buffer_max_{buffer_max}, io_timeout_{io_timeout} {}
+  Relay(const vector<string>& url, int interval, Log::Facility facility, Log::Level level, int receivers = 1, int stale = 30, const string& spool = "", const vector<string>& batch = {}, const vector<string>& format = {}, const string& mqtt = "", int qos = 0, int metrics = 0, const vector<int>& ports = {50222}, int buffer_max = 1024, int queue_max = 128, int batch_max = 16, int ring_max = 1024):
+    url_{url}, http_{url, spool}, mqtt_{mqtt, qos}, metrics_port_{metrics}, interval_{interval * 60}, facility_{facility}, level_{level}, ports_{ports}, buffer_max_{buffer_max}, batch_max_{batch_max} {
+
+    // One independent codec per receiver so shards never contend with each other
+    for (int idx = 0; idx < max(receivers, 1); idx++) shard_.emplace_back(new Shard(queue_max, stale * 60, ring_max, buffer_max, Exporting()? &metrics_: nullptr, &feed_, &state_, &store_));
+
+    // Signaled once at exit to wake up the receiver(s) immediately
+    exit_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // Signaled by the decoder(s) when there are messages to publish or stream to subscribers
+    publish_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    subscribe_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    transmitter_deadline_ = chrono::steady_clock::now() + chrono::seconds(interval_);
+
+    // Batch mode of each destination: "<ndjson|array>[:hub]", "<lines>" or "" for one request per sensor
+    batch_.resize(url.size());
+    for (size_t idx = 0; idx < batch.size() && idx < url.size(); idx++) {
+      const string& mode = batch[idx];
+
+      if (!mode.empty() && isdigit((unsigned char)mode[0])) batch_[idx].lines = stoul(mode);
+      else if (!mode.compare(0, 6, "ndjson")) batch_[idx].framing = Batch::NDJSON;
+      else if (!mode.compare(0, 5, "array")) batch_[idx].framing = Batch::ARRAY;
+      batch_[idx].hub = mode.size() > 4 && !mode.compare(mode.size() - 4, 4, ":hub");
+
+      if (batch_[idx].framing == Batch::NDJSON) http_.SetContentType(idx, "application/x-ndjson");
+    }
+
+    // Payload format of each destination: only the formats in use are encoded
+    format_.resize(url.size(), FORMAT_ECOWITT);
+    for (size_t idx = 0; idx < format.size() && idx < url.size(); idx++) {
+      if (format[idx] == "weatherflow") format_[idx] = FORMAT_WEATHERFLOW;
+      else if (format[idx] == "influx") {
+        format_[idx] = FORMAT_INFLUX;
+        http_.SetContentType(idx, "text/plain; charset=utf-8");
+
+        // Wake up the transmitter as soon as the smallest batch is complete
+        if (batch_[idx].lines && (!influx_lines_ || batch_[idx].lines < influx_lines_)) influx_lines_ = batch_[idx].lines;
+      }
+    }
+
+    for (Format fmt: format_) read_[fmt] = true;
+    if (url.empty()) read_[FORMAT_ECOWITT] = true;
+  }
+
+  ~Relay() {
+    if (exit_event_ != -1) close(exit_event_);
+    if (publish_event_ != -1) close(publish_event_);
+    if (subscribe_event_ != -1) close(subscribe_event_);
+  }
 
   inline void Stop(void) { Exit(); }
 
-  int Receiver() {
+  inline size_t Receivers(void) const { return (shard_.size()); }
+  inline bool Publishing(void) const { return (mqtt_.Enabled()); }
+  inline bool Exporting(void) const { return (metrics_port_ != 0); }
+  inline bool Subscribed(void) const { return (subscribers_.load(memory_order_relaxed) != 0); }
+  inline bool Saving(void) const { return (!state_path_.empty()); }
+
+  int Receiver(size_t shard) {
     int err = EXIT_SUCCESS;
-    int sock = -1;
+    int poll = -1;
+    vector<int> socks;
 
     bool trace = url_.empty() && !interval_;
 
@@ -41,171 +101,735 @@ public:
     Log log{facility_, level_};
 
     try {
-      TLOG_INFO(log) << "Receiver started." << endl;
+      TLOG_INFO(log) << "Receiver " << shard << " started." << endl;
 
-      // Create a best-effort datagram socket using UDP
-      if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-        TLOG_ERROR(log) << "socket() failed: " << strerror(errno) << "." << endl;
-        throw runtime_error("socket()");
+      // Create the event loop and have it watch the exit event
+      if ((poll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        TLOG_ERROR(log) << "epoll_create1() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("epoll_create1()");
       }
 
-      // Construct bind structure and bind to the broadcast port
-      struct sockaddr_in broadcast_addr;                        // broadcast address
-      memset(&broadcast_addr, 0, sizeof(broadcast_addr));       // zero out structure
-      broadcast_addr.sin_family = AF_INET;                      // internet address family
-      broadcast_addr.sin_addr.s_addr = htonl(INADDR_ANY);       // any incoming interface
-      broadcast_addr.sin_port = htons(port_);                   // broadcast port
+      struct epoll_event poll_event;
+      poll_event.events = EPOLLIN;
+      poll_event.data.fd = exit_event_;
 
-      if (bind(sock, (const struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr)) == -1) {
-        TLOG_ERROR(log) << "bind() failed: " << strerror(errno) << "." << endl;
-        throw runtime_error("bind()");
+      if (epoll_ctl(poll, EPOLL_CTL_ADD, exit_event_, &poll_event) == -1) {
+        TLOG_ERROR(log) << "epoll_ctl() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("epoll_ctl()");
       }
 
-      // Receive a single datagram from the server
-      struct sockaddr_in receive_addr;
-      socklen_t receive_addr_len = sizeof(receive_addr);
-      char receive_buffer[buffer_max_];                         // buffer for received data
-      size_t receive_len;                                       // length of received data
-
-      struct timeval receive_to;
-      receive_to.tv_sec = io_timeout_;
-      receive_to.tv_usec = 0;
-      fd_set receive_fds;
-
-      do {
-        FD_ZERO(&receive_fds);
-        FD_SET(sock, &receive_fds);
-
-        switch (select(sock + 1, &receive_fds, NULL, NULL, &receive_to)) {
-        case -1:
-          TLOG_ERROR(log) << "select() failed: " << strerror(errno) << "." << endl;
-          throw runtime_error("select()");
-
-        case 0:
-          // Timeout
-          receive_len = 0;
-          break;
-
-        default:
-          if ((receive_len = recvfrom(sock, receive_buffer, sizeof(receive_buffer) - 1, 0, (struct sockaddr *) &receive_addr, &receive_addr_len)) == -1) {
-            TLOG_ERROR(log) << "recvfrom() failed: " << strerror(errno) << "." << endl;
-            throw runtime_error("recvfrom()");
+      for (int port: ports_) {
+        // Create a best-effort datagram socket using UDP
+        int sock;
+
+        if ((sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP)) == -1) {
+          TLOG_ERROR(log) << "socket() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("socket()");
+        }
+
+        socks.push_back(sock);
+
+        // Let the kernel spread datagrams across receivers: it hashes the source address
+        // so packets from the same hub always land, in order, on the same shard
+        int reuse = 1;
+
+        if (shard_.size() > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+          TLOG_ERROR(log) << "setsockopt() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("setsockopt()");
+        }
+
+        // Construct bind structure and bind to the broadcast port
+        struct sockaddr_in broadcast_addr;                      // broadcast address
+        memset(&broadcast_addr, 0, sizeof(broadcast_addr));     // zero out structure
+        broadcast_addr.sin_family = AF_INET;                    // internet address family
+        broadcast_addr.sin_addr.s_addr = htonl(INADDR_ANY);     // any incoming interface
+        broadcast_addr.sin_port = htons(port);                  // broadcast port
+
+        if (bind(sock, (const struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr)) == -1) {
+          TLOG_ERROR(log) << "bind() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("bind()");
+        }
+
+        poll_event.events = EPOLLIN;
+        poll_event.data.fd = sock;
+
+        if (epoll_ctl(poll, EPOLL_CTL_ADD, sock, &poll_event) == -1) {
+          TLOG_ERROR(log) << "epoll_ctl() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("epoll_ctl()");
+        }
+      }
+
+      // Receive up to batch_max_ datagrams per wakeup straight into the decoder ring slots
+      // or, when tracing or the ring is full, into a preallocated multi-buffer array
+      Ring& ring = shard_[shard]->ring_;
+
+      vector<char> receive_buffer(batch_max_ * buffer_max_);   // buffers for received data
+      vector<struct sockaddr_in> receive_addr(batch_max_);      // per datagram source address
+      vector<struct iovec> receive_iov(batch_max_);
+      vector<struct mmsghdr> receive_msg(batch_max_);
+      int receive_len;                                          // number of received datagrams
+
+      for (int idx = 0; idx < batch_max_; idx++) {
+        receive_iov[idx].iov_base = &receive_buffer[idx * buffer_max_];
+        receive_iov[idx].iov_len = buffer_max_ - 1;             // leave room for the terminator
+
+        memset(&receive_msg[idx], 0, sizeof(receive_msg[idx]));
+        receive_msg[idx].msg_hdr.msg_name = &receive_addr[idx];
+        receive_msg[idx].msg_hdr.msg_iov = &receive_iov[idx];
+        receive_msg[idx].msg_hdr.msg_iovlen = 1;
+      }
+
+      vector<struct epoll_event> poll_events(socks.size() + 1);
+      int poll_len;
+
+      while (Continue()) {
+        // Sleep until we get data or the exit event is signaled
+        if ((poll_len = epoll_wait(poll, poll_events.data(), poll_events.size(), -1)) == -1) {
+          if (errno == EINTR) continue;
+
+          TLOG_ERROR(log) << "epoll_wait() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("epoll_wait()");
+        }
+
+        for (int event = 0; event < poll_len; event++) {
+          int sock = poll_events[event].data.fd;
+          if (sock == exit_event_) continue;
+
+          size_t receive_max = trace? 0: min<size_t>(ring.Free(), batch_max_);
+
+          for (size_t idx = 0; idx < (size_t)batch_max_; idx++) {
+            // recvmmsg() overwrites the address lengths so we need to reset them every time
+            receive_msg[idx].msg_hdr.msg_namelen = sizeof(receive_addr[idx]);
+            receive_iov[idx].iov_base = (idx < receive_max)? ring.SlotFree(idx): &receive_buffer[idx * buffer_max_];
           }
 
-          if (receive_len < 0 || receive_len >= sizeof(receive_buffer)) {
-            TLOG_ERROR(log) << "recvfrom() returned: " << receive_len << " bytes." << endl;
-            throw runtime_error("recvfrom()");
+          if ((receive_len = recvmmsg(sock, receive_msg.data(), batch_max_, MSG_DONTWAIT, nullptr)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+
+            TLOG_ERROR(log) << "recvmmsg() failed: " << strerror(errno) << "." << endl;
+            throw runtime_error("recvmmsg()");
           }
-        }
 
-        if (receive_len) {
           // We got data, let's terminate it
-          receive_buffer[receive_len] = '\0';
+          for (int idx = 0; idx < receive_len; idx++) {
+            ((char*)receive_iov[idx].iov_base)[receive_msg[idx].msg_len] = '\0';
+          }
 
           if (trace) {
             // Trace
-            cout << receive_buffer << endl;
+            for (int idx = 0; idx < receive_len; idx++) cout << (const char*)receive_iov[idx].iov_base << endl;
           }
           else {
-            // Write data to tempest
-            Write(log, receive_buffer, receive_len);
+            // Hand the datagrams that fit over to the decoder and count the others as overflow
+            size_t pushed = min<size_t>(receive_len, receive_max);
+
+            for (size_t idx = 0; idx < pushed; idx++) ring.SetLength(idx, receive_msg[idx].msg_len);
+            if (Exporting()) {
+              int64_t now = Steady();
+              for (size_t idx = 0; idx < pushed; idx++) ring.SetStamp(idx, now);
+            }
+            ring.Push(pushed);
+
+            shard_[shard]->tempest_.UdpReceived(receive_len, receive_len - pushed);
+            if (pushed) Signal(shard_[shard]->ring_event_);
           }
         }
       }
-      while (Continue());
     }
     catch (exception const & ex) {
       err = EXIT_FAILURE;
     }
 
-    if (sock != -1) close(sock);
+    for (int sock: socks) close(sock);
+    if (poll != -1) close(poll);
     Exit(err != EXIT_SUCCESS, true);
-    TLOG_INFO(log) << "Receiver ended with return code = " << err << "." << endl;
+    TLOG_INFO(log) << "Receiver " << shard << " ended with return code = " << err << "." << endl;
+
+    return (err);
+  }
+
+  int Decoder(size_t shard) {
+    //
+    // Drain the receiver ring of a shard into its tempest codec
+    //
+    int err = EXIT_SUCCESS;
+
+    Shard& decode = *shard_[shard];
+    Ring& ring = decode.ring_;
+
+    UdpMessage event;
+    vector<pair<string, string>> publish;                       // topic (without the MQTT prefix), payload
+
+    // Initialize log stream
+    Log log{facility_, level_};
+
+    struct pollfd poll_fds[2];
+    poll_fds[0].fd = decode.ring_event_;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = exit_event_;
+    poll_fds[1].events = POLLIN;
+
+    try {
+      TLOG_INFO(log) << "Decoder " << shard << " started." << endl;
+
+      for (;;) {
+        size_t size = ring.Size();
+
+        if (size) {
+          // Decode everything available under a single acquisition of the tempest lock
+          bool notify = false, notify_one;
+          bool subscribed = Subscribed();
+
+          {
+            scoped_lock<mutex> lock{decode.tempest_access_};
+
+            for (size_t idx = 0; idx < size; idx++) {
+              TLOGF_DEBUG(log, "Receiver {} datagram: {}", shard, string_view{ring.Slot(idx), ring.Length(idx)});
+
+              if (!decode.tempest_.WriteUdp(log, ring.Slot(idx), ring.Length(idx), notify_one, event)) continue;
+              if (notify_one) notify = true;
+
+              // Every decoded event is published and streamed as received, on [<prefix>/]<hub>/<sensor>/<type>
+              if (Publishing() || subscribed) {
+                string topic;
+
+                if (event.event != UDP_HUB_STATUS) {
+                  Mqtt::Level(topic, event.hub_sn);
+                  topic += '/';
+                }
+                Mqtt::Level(topic, event.serial_number);
+                topic += '/';
+                topic += UdpMessage::Tag(event.event);
+
+                publish.emplace_back(move(topic), string{ring.Slot(idx), ring.Length(idx)});
+              }
+            }
+
+            if (influx_lines_ && decode.tempest_.Observations() - decode.influx_read_ >= influx_lines_) notify = true;
+
+            ShareUdp(shard);
+          }
+
+          if (Exporting()) {
+            int64_t now = Steady();
+            for (size_t idx = 0; idx < size; idx++) metrics_.receive_.Observe((now - ring.Stamp(idx)) / 1e9);
+          }
+
+          ring.Pop(size);
+
+          // Report blocks the store failed to write since last time, once across all the decoders
+          uint64_t reported = store_reported_.load(memory_order_relaxed), errors = store_.Errors();
+          if (errors != reported && store_reported_.compare_exchange_strong(reported, errors, memory_order_relaxed)) {
+            TLOG_WARNING(log) << "Error writing " << (errors - reported) << " block(s) to the store in " << store_dir_ << "." << endl;
+          }
+
+          reported = store_rejected_.load(memory_order_relaxed), errors = store_.Rejected();
+          if (errors != reported && store_rejected_.compare_exchange_strong(reported, errors, memory_order_relaxed)) {
+            TLOG_WARNING(log) << "Not storing " << (errors - reported) << " sensor(s): invalid serial number or more than " << Store::SERIES_MAX << " sensors." << endl;
+          }
+
+          if (!publish.empty()) {
+            // Hand over to the controller and the publisher and wake them up
+            if (subscribed) {
+              {
+                scoped_lock<mutex> lock{subscribe_access_};
+
+                if (Publishing()) subscribe_.insert(subscribe_.end(), publish.begin(), publish.end());
+                else for (auto& message: publish) subscribe_.emplace_back(move(message));
+              }
+
+              Signal(subscribe_event_);
+            }
+
+            if (Publishing()) {
+              {
+                scoped_lock<mutex> lock{publish_access_};
+
+                for (auto& message: publish) publish_.emplace_back(move(message));
+              }
+
+              Signal(publish_event_);
+            }
+
+            publish.clear();
+          }
+
+          if (notify) {
+            // wake up the transmitter if he's sleeping
+            scoped_lock<mutex> lock{transmitter_access_};
+
+            transmitter_notify_ = true;
+            transmitter_.notify_one();
+            http_.Wakeup();
+          }
+        }
+        else if (!Continue()) break;
+        else {
+          // Sleep until the receiver pushes more data or the exit event is signaled
+          if (poll(poll_fds, 2, -1) == -1 && errno != EINTR) {
+            TLOG_ERROR(log) << "poll() failed: " << strerror(errno) << "." << endl;
+            throw runtime_error("poll()");
+          }
+
+          uint64_t signal;
+          if (read(decode.ring_event_, &signal, sizeof(signal)) == -1) {}
+        }
+      }
+    }
+    catch (exception const & ex) {
+      err = EXIT_FAILURE;
+    }
+
+    Exit(err != EXIT_SUCCESS, true);
+    TLOG_INFO(log) << "Decoder " << shard << " ended with return code = " << err << "." << endl;
 
     return (err);
   }
 
   int Transmitter() {
     int err = EXIT_SUCCESS;
-    int err_consecutive = 0;
 
     // Initialize log
     Log log{facility_, level_};
 
-    bool trace = url_.empty() && interval_;
-
-    vector<string> data;
-    size_t event;
+    bool trace = url_.empty() && !Publishing() && interval_;
 
-    struct curl_slist* slist = nullptr;
-    CURL* curl = nullptr;
-    CURLcode res;
+    vector<string> data[FORMAT_MAX];
+    size_t event, pending = 0;
 
     try {
       TLOG_INFO(log) << "Trasmitter started." << endl;
 
-      if (!trace) {
-        // Initialize CURL library
-        res = curl_global_init(CURL_GLOBAL_ALL);
-        if (res != CURLE_OK) {
-          TLOG_ERROR(log) << "curl_global_init() failed: " << curl_easy_strerror(res) << "." << endl;
-          throw runtime_error("curl_global_init()");
+      if (url_.empty() && !trace) {
+        // Tracing the source UDP JSON or only publishing: nothing to transmit, just wait to be told to exit
+        unique_lock<mutex> lock{transmitter_access_};
+
+        transmitter_.wait(lock, [this] { return (!Continue()); });
+      }
+      else if (!trace) {
+        // Start delivering anything spooled by a previous run right away
+        {
+          scoped_lock<mutex> lock{transmitter_access_};
+
+          http_.Open(log);
         }
+        pending = http_.Perform(log, 0);
+      }
 
-        // Add slist string
-        slist = curl_slist_append(nullptr, "Content-Type: application/json");
-        if (!slist) {
-          TLOG_ERROR(log) << "curl_slist_append() returned a NULL pointer." << endl;
-          throw runtime_error("curl_slist_append()");
+      while (Continue()) {
+
+        // While requests are in flight only check for new data: the wait happens in Perform()
+        for (vector<string>& payload: data) payload.clear();
+        event = Read(log, data, !pending);
+
+        if (trace) {
+          // Trace
+          for (size_t idx = data[FORMAT_ECOWITT].size(); idx--; ) cout << data[FORMAT_ECOWITT][idx] << endl;
+        }
+        else if (event) {
+          // Transmit data to every destination
+          Post(data);
         }
 
-        // Get a curl handle
-        curl = curl_easy_init();
-        if (!curl) {
-          TLOG_ERROR(log) << "curl_easy_init() returned a NULL pointer." << endl;
-          throw runtime_error("curl_easy_init()");
+        // Failed requests are spooled and retried: an unreachable destination never stops the relay
+        if (!trace) {
+          pending = http_.Perform(log, Timeout());
+          ShareHttp();
         }
+      }
+    }
+    catch (exception const & ex) {
+      err = EXIT_FAILURE;
+    }
 
-        // Verbose
-        // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    if (!trace) {
+      scoped_lock<mutex> lock{transmitter_access_};
 
-        // Set the URL that is about to receive our POST
-        curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
+      http_.Flush(log);
+      http_.Close();
+    }
+
+    Exit(err != EXIT_SUCCESS);
+    TLOG_INFO(log) << "Trasmitter ended with return code = " << err << "." << endl;
+
+    return (err);
+  }
 
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+  int Publisher() {
+    //
+    // Publish decoded events to the MQTT broker as soon as the decoder(s) hand them over
+    //
+    int err = EXIT_SUCCESS;
+
+    // Initialize log
+    Log log{facility_, level_};
 
-        // Enable location redirects
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 1);
-        curl_easy_setopt(curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+    vector<pair<string, string>> publish;                       // topic, payload
 
-        // Set timeout
-        // curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);
+    struct pollfd poll_fds[3];
+    poll_fds[0].fd = publish_event_;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = exit_event_;
+    poll_fds[1].events = POLLIN;
+
+    try {
+      TLOG_INFO(log) << "Publisher started." << endl;
+
+      short revents = 0;
+
+      while (Continue()) {
+        {
+          scoped_lock<mutex> lock{publish_access_};
+
+          publish.swap(publish_);
+        }
+
+        for (auto& [topic, payload]: publish) mqtt_.Publish(mqtt_.Prefix() + '/' + topic, payload);
+        publish.clear();
+
+        // Connect, write everything queued in one go, handle acknowledgements and keep alive
+        mqtt_.Perform(log, revents);
+        ShareMqtt();
+
+        // Sleep until there is something to publish, the socket is ready, a timer expires or the exit event is signaled
+        poll_fds[2].fd = mqtt_.Fd();
+        poll_fds[2].events = mqtt_.Events();
+        poll_fds[2].revents = 0;
+
+        if (poll(poll_fds, (mqtt_.Fd() == -1)? 2: 3, mqtt_.Timeout()) == -1 && errno != EINTR) {
+          TLOG_ERROR(log) << "poll() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("poll()");
+        }
+
+        revents = poll_fds[2].revents;
+
+        uint64_t signal;
+        if (read(publish_event_, &signal, sizeof(signal)) == -1) {}
+      }
+    }
+    catch (exception const & ex) {
+      err = EXIT_FAILURE;
+    }
+
+    mqtt_.Disconnect(log);
+
+    Exit(err != EXIT_SUCCESS);
+    TLOG_INFO(log) << "Publisher ended with return code = " << err << "." << endl;
+
+    return (err);
+  }
+
+  int Saver() {
+    //
+    // Save the sensor accumulations every STATE_PERIOD seconds (and once more at exit, see Save())
+    //
+    int err = EXIT_SUCCESS;
+
+    // Initialize log
+    Log log{facility_, level_};
+
+    struct pollfd poll_fd = {exit_event_, POLLIN, 0};
+
+    TLOG_INFO(log) << "Saver started." << endl;
+
+    while (Continue()) {
+      if (poll(&poll_fd, 1, STATE_PERIOD * 1000) == -1 && errno != EINTR) {
+        TLOG_ERROR(log) << "poll() failed: " << strerror(errno) << "." << endl;
+        err = EXIT_FAILURE;
+        break;
+      }
+
+      if (Continue()) Save(log);
+    }
+
+    Exit(err != EXIT_SUCCESS);
+    TLOG_INFO(log) << "Saver ended with return code = " << err << "." << endl;
+
+    return (err);
+  }
+
+  int Exporter() {
+    //
+    // Serve GET /metrics in the Prometheus text format: everything is read from atomics so a scrape never takes
+    // the tempest lock and never delays the receivers or decoders
+    //
+    int err = EXIT_SUCCESS;
+    int sock = -1;
+
+    // Initialize log
+    Log log{facility_, level_};
+
+    try {
+      TLOG_INFO(log) << "Exporter started." << endl;
+
+      if ((sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) == -1) {
+        TLOG_ERROR(log) << "socket() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("socket()");
       }
 
+      int reuse = 1;
+
+      if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
+        TLOG_ERROR(log) << "setsockopt() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("setsockopt()");
+      }
+
+      struct sockaddr_in listen_addr;
+      memset(&listen_addr, 0, sizeof(listen_addr));
+      listen_addr.sin_family = AF_INET;
+      listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      listen_addr.sin_port = htons(metrics_port_);
+
+      if (bind(sock, (const struct sockaddr *) &listen_addr, sizeof(listen_addr)) == -1) {
+        TLOG_ERROR(log) << "bind() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("bind()");
+      }
+
+      if (listen(sock, 8) == -1) {
+        TLOG_ERROR(log) << "listen() failed: " << strerror(errno) << "." << endl;
+        throw runtime_error("listen()");
+      }
+
+      struct pollfd poll_fds[2];
+      poll_fds[0].fd = sock;
+      poll_fds[0].events = POLLIN;
+      poll_fds[1].fd = exit_event_;
+      poll_fds[1].events = POLLIN;
+
+      string request, response, body;
+
       while (Continue()) {
+        // Sleep until a scraper connects or the exit event is signaled
+        if (poll(poll_fds, 2, -1) == -1) {
+          if (errno == EINTR) continue;
 
-        data.clear();
-        event = Read(log, data);
-        while (event--) {
+          TLOG_ERROR(log) << "poll() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("poll()");
+        }
 
-          if (trace) {
-            // Trace
-            cout << data[event] << endl;
+        int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) continue;
+
+        // One request per connection, served in place: a stalled scraper times out instead of blocking the exit
+        struct timeval timeout = {2, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char buffer[1024];
+        ssize_t len;
+
+        request.clear();
+        while (request.find("\r\n\r\n") == string::npos && request.size() < 8192 && (len = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+          request.append(buffer, len);
+        }
+
+        if (!request.compare(0, 13, "GET /metrics ") || !request.compare(0, 13, "GET /metrics?")) {
+          body.clear();
+          Expose(body);
+
+          response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+        }
+        else {
+          body = "Not Found\n";
+          response = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain; charset=utf-8\r\n";
+        }
+
+        response += "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        response += body;
+
+        for (size_t sent = 0; sent < response.size(); sent += len) {
+          if ((len = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL)) <= 0) break;
+        }
+
+        close(client);
+      }
+    }
+    catch (exception const & ex) {
+      err = EXIT_FAILURE;
+    }
+
+    if (sock != -1) close(sock);
+
+    Exit(err != EXIT_SUCCESS);
+    TLOG_INFO(log) << "Exporter ended with return code = " << err << "." << endl;
+
+    return (err);
+  }
+
+  int Controller(const string version) {
+    //
+    // Serve the control channel: STOP, STATS, VERSION and SUBSCRIBE over length-prefixed frames on a Unix domain
+    // socket. Subscribers get every decoded event as the decoders hand them over
+    //
+    int err = EXIT_SUCCESS;
+    int sock = -1;
+
+    // Initialize log
+    Log log{facility_, level_};
+
+    struct Client {
+      int sock;
+      string in;
+      string out;
+      bool subscribed;
+    };
+
+    vector<Client> client;
+    vector<pair<string, string>> subscribe;                     // topic, payload
+    vector<struct pollfd> poll_fds;
+    string line;
+
+    try {
+      TLOG_INFO(log) << "Controller started." << endl;
+
+      struct sockaddr_un addr;
+      socklen_t addr_len;
+
+      Control::Address(addr, addr_len);
+
+      // Anyone on the host can take the abstract name first: without the channel the relay still runs and is
+      // controlled through signals, so it's not worth exiting for
+      if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+          bind(sock, (const struct sockaddr *) &addr, addr_len) == -1 || listen(sock, 8) == -1) {
+        TLOG_WARNING(log) << "Control channel unavailable, running without: " << strerror(errno) << "." << endl;
+        if (sock != -1) close(sock);
+        sock = -1;
+      }
+
+      while (Continue()) {
+        // Hand decoded events over to every subscriber
+        {
+          scoped_lock<mutex> lock{subscribe_access_};
+
+          subscribe.swap(subscribe_);
+        }
+
+        for (Client& cli: client) {
+          if (!cli.subscribed) continue;
+
+          for (auto& [topic, payload]: subscribe) {
+            line = topic;
+            line += ' ';
+            line += payload;
+            Control::Frame(cli.out, 0, line);
           }
-          else {
-            // Transmit data
-            // Specify the POST data and its lenght
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data[event].c_str());
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, data[event].length());
-
-            // Perform the request, res will get the return code
-            res = curl_easy_perform(curl);
-            if (res != CURLE_OK) {
-              TLOG_ERROR(log) << "curl_easy_perform() failed: " << curl_easy_strerror(res) << "." << endl;
-              if (++err_consecutive == 5) throw runtime_error("curl_easy_perform()");
+
+          if (cli.out.size() > SUBSCRIBE_MAX) {
+            // Never let a stalled reader grow without bound
+            TLOG_WARNING(log) << "Control subscriber not reading: disconnected." << endl;
+            shutdown(cli.sock, SHUT_RDWR);
+            cli.subscribed = false;
+            cli.out.clear();
+            subscribers_--;
+          }
+        }
+        subscribe.clear();
+
+        // Sleep until a client connects, sends, can be written to, events are handed over or the exit event is signaled
+        // (poll() skips a negative sock: without the channel only the exit event)
+        poll_fds.resize(3 + client.size());
+        poll_fds[0] = {sock, POLLIN, 0};
+        poll_fds[1] = {exit_event_, POLLIN, 0};
+        poll_fds[2] = {subscribe_event_, POLLIN, 0};
+        for (size_t idx = 0; idx < client.size(); idx++) {
+          poll_fds[3 + idx] = {client[idx].sock, (short)(POLLIN | (client[idx].out.empty()? 0: POLLOUT)), 0};
+        }
+
+        if (poll(poll_fds.data(), poll_fds.size(), -1) == -1) {
+          if (errno == EINTR) continue;
+
+          TLOG_ERROR(log) << "poll() failed: " << strerror(errno) << "." << endl;
+          throw runtime_error("poll()");
+        }
+
+        uint64_t signal;
+        if (read(subscribe_event_, &signal, sizeof(signal)) == -1) {}
+
+        for (size_t idx = 0; idx < client.size(); idx++) {
+          Client& cli = client[idx];
+          short revents = poll_fds[3 + idx].revents;
+          bool closed = revents & (POLLERR | POLLNVAL);
+          ssize_t len;
+
+          if (!closed && (revents & (POLLIN | POLLHUP))) {
+            char buffer[1024];
+            string body;
+            uint8_t code;
+
+            if ((len = recv(cli.sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) cli.in.append(buffer, len);
+            else if (len == 0 || (errno != EAGAIN && errno != EINTR)) closed = true;
+
+            while (!closed && Control::Parse(cli.in, code, body)) {
+              string reply;
+              error_t result = 0;
+
+              switch (code) {
+              case Control::STOP:
+                reply = to_string(getpid());
+                Exit(true);
+                break;
+
+              case Control::STATS:
+                if (!stats_ || !stats_->Format(reply)) result = EAGAIN;
+                break;
+
+              case Control::VERSION:
+                reply = version;
+                break;
+
+              case Control::SUBSCRIBE:
+                if (!cli.subscribed) {
+                  cli.subscribed = true;
+                  subscribers_++;
+                }
+                break;
+
+              default:
+                // Unknown command or a frame that could never be valid
+                result = (code == EPROTO)? EPROTO: EINVAL;
+                if (code == EPROTO) closed = true;
+                break;
+              }
+
+              Control::Frame(cli.out, result, reply);
+            }
+          }
+
+          if (!closed && !cli.out.empty()) {
+            if ((len = send(cli.sock, cli.out.data(), cli.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL)) > 0) cli.out.erase(0, len);
+            else if (len == -1 && errno != EAGAIN && errno != EINTR) closed = true;
+          }
+
+          if (closed) {
+            if (cli.subscribed) subscribers_--;
+            close(cli.sock);
+            cli.sock = -1;
+          }
+        }
+
+        client.erase(remove_if(client.begin(), client.end(), [](const Client& cli) { return (cli.sock == -1); }), client.end());
+
+        if (poll_fds[0].revents & POLLIN) {
+          int cli_sock;
+
+          while ((cli_sock = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            // The abstract namespace has no file permissions: only our own user (or root) may control the relay
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+
+            if (getsockopt(cli_sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+              TLOG_WARNING(log) << "Control connection refused: " << strerror(errno) << "." << endl;
+              close(cli_sock);
+              continue;
+            }
+
+            if (cred.uid != geteuid() && cred.uid != 0) {
+              TLOG_WARNING(log) << "Control connection refused (uid " << cred.uid << ")." << endl;
+              close(cli_sock);
+              continue;
             }
-            else err_consecutive = 0; 
+
+            client.push_back({cli_sock, "", "", false});
           }
         }
       }
@@ -214,42 +838,221 @@ public:
       err = EXIT_FAILURE;
     }
 
-    if (!trace) {
-      // Free the list again
-      if (slist) curl_slist_free_all(slist);
-
-      // Cleanup
-      if (curl) curl_easy_cleanup(curl);
-
-      curl_global_cleanup();
+    for (Client& cli: client) {
+      if (cli.subscribed) subscribers_--;
+      close(cli.sock);
     }
+    if (sock != -1) close(sock);
 
     Exit(err != EXIT_SUCCESS);
-    TLOG_INFO(log) << "Trasmitter ended with return code = " << err << "." << endl;
+    TLOG_INFO(log) << "Controller ended with return code = " << err << "." << endl;
 
     return (err);
   }
 
-  string Stats(void) {
+  void Share(StatsData* stats) {
+    //
+    // Publish statistics to stats (in shared memory) and the latest conditions of every sensor to the feed from now
+    // on: call before starting the threads. Each section has a single writer (a decoder, the transmitter or the
+    // publisher) and is updated as it changes, so readers never signal or block the relay
+    //
+    Log log{facility_, level_};
+    error_t err;
+
+    if (err = feed_.Initialize()) TLOG_WARNING(log) << "Error initializing the conditions feed: " << strerror(err) << "." << endl;
+
+    stats_ = stats;
+    if (!stats_) return;
+
+    stats_->receivers = min(shard_.size(), StatsData::RECEIVER_MAX);
+    stats_->http = http_.Destinations();
+    stats_->mqtt = Publishing();
+
+    for (size_t idx = 0; idx < stats_->receivers; idx++) ShareUdp(idx);
+    ShareHttp();
+    ShareMqtt();
+
+    stats_->pid.store(getpid(), memory_order_release);
+  }
+
+  void Restore(const string& path) {
+    //
+    // Resume the sensor accumulations saved in path by a previous run and save them there from now on: call before
+    // starting the threads. A missing or incompatible snapshot only means starting from zero
+    //
+    Log log{facility_, level_};
+    error_t err;
+
+    state_path_ = path;
+
+    if (!(err = state_.Load(path))) TLOG_INFO(log) << "Restored " << state_.Size() << " sensor(s) from " << path << ", saved " << (time(nullptr) - state_.Saved()) << "s ago." << endl;
+    else if (err == EPROTO) TLOG_WARNING(log) << "Ignoring " << path << ": saved by an incompatible version or truncated." << endl;
+    else if (err != ENOENT) TLOG_WARNING(log) << "Error loading " << path << ": " << strerror(err) << "." << endl;
+  }
+
+  void Save(void) {
+    // At exit, once the decoders are done
+    Log log{facility_, level_};
+
+    if (Saving()) Save(log);
+  }
+
+  void OpenStore(const string& dir) {
     //
-    // Return tempest data structure statistics
+    // Append every observation to a time-series segment per sensor and month in dir: call before starting the
+    // threads. If dir can't be created the relay runs without
     //
-    scoped_lock<mutex> lock{tempest_access_};
+    Log log{facility_, level_};
+    string names;
+    error_t err;
+
+    for (int field = 0; field < History::FIELD_MAX; field++) {
+      if (field) names += ',';
+      names += History::Name((History::Field)field);
+    }
+
+    store_dir_ = dir;
 
-    return (StatsUdp());
+    if (err = store_.Open(dir, History::FIELD_MAX, names)) TLOG_ERROR(log) << "Error opening the store in " << dir << ": " << strerror(err) << "." << endl;
+  }
+
+  void CloseStore(void) {
+    // At exit, once the decoders are done: write the observations of the last partial blocks
+    store_.Flush();
   }
 
 private:
 
+  static constexpr int STATE_PERIOD = 60;                       // seconds between snapshots
+
+  void Save(Log& log) {
+    vector<StateRecord> records;
+    error_t err;
+
+    for (auto& shard: shard_) {
+      scoped_lock<mutex> lock{shard->tempest_access_};
+
+      shard->tempest_.Save(records);
+    }
+
+    if (err = state_.Save(state_path_, records)) TLOG_ERROR(log) << "Error saving " << state_path_ << ": " << strerror(err) << "." << endl;
+  }
+
+  struct Shard {
+    Shard(size_t queue_max, time_t stale, size_t ring_max, size_t buffer_max, Metrics* metrics, Feed* feed, const State* state, Store* store): tempest_{queue_max, stale, metrics, feed, state, store}, ring_{ring_max, buffer_max} {
+      ring_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~Shard() {
+      if (ring_event_ != -1) close(ring_event_);
+    }
+
+    Tempest tempest_;
+    mutex tempest_access_;
+
+    Ring ring_;                                                 // receiver -> decoder datagrams
+    int ring_event_;                                            // eventfd signaled on push
+
+    uint64_t influx_read_ = 0;                                  // tempest_.Observations() at the last line protocol read
+  };
+
+  inline void ShareUdp(size_t shard) {
+    // Caller holds the shard tempest lock (or no other thread is running yet)
+    if (stats_ && shard < StatsData::RECEIVER_MAX) stats_->udp[shard].Write([&](UdpSnapshot& stats) { shard_[shard]->tempest_.Snapshot(stats); });
+  }
+
+  inline void ShareHttp(void) {
+    if (stats_) stats_->destinations.Write([this](HttpSnapshot& stats) { http_.Snapshot(stats); });
+  }
+
+  inline void ShareMqtt(void) {
+    if (stats_) stats_->broker.Write([this](MqttSnapshot& stats) { mqtt_.Snapshot(stats); });
+  }
+
+  static inline int64_t Steady(void) {
+    // Monotonic nanoseconds for latency measurements
+    return (chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  void Expose(string& text) {
+    //
+    // Append every metric family in the Prometheus text format, samples of the same family grouped across shards
+    //
+    string sample[Tempest::FAMILY_MAX];
+
+    for (size_t idx = 0; idx < shard_.size(); idx++) {
+      shard_[idx]->tempest_.Expose(sample, Exposition::Label("receiver", to_string(idx)));
+    }
+
+    for (int family = 0; family < Tempest::FAMILY_MAX; family++) {
+      Exposition::Family(text, Tempest::family_[family].name, Tempest::family_[family].type, Tempest::family_[family].help);
+      text += sample[family];
+    }
+
+    Exposition::Family(text, "tempest_ring_depth", "gauge", "Datagrams waiting in the receiver to decoder ring.");
+    for (size_t idx = 0; idx < shard_.size(); idx++) {
+      Exposition::Sample(text, "tempest_ring_depth", Exposition::Label("receiver", to_string(idx)), shard_[idx]->ring_.Depth());
+    }
+
+    Exposition::Family(text, "tempest_ring_capacity", "gauge", "Receiver to decoder ring slots.");
+    for (size_t idx = 0; idx < shard_.size(); idx++) {
+      Exposition::Sample(text, "tempest_ring_capacity", Exposition::Label("receiver", to_string(idx)), shard_[idx]->ring_.Capacity());
+    }
+
+    Exposition::Family(text, "tempest_receive_latency_seconds", "histogram", "Time from datagram received to decoded.");
+    metrics_.receive_.Expose(text, "tempest_receive_latency_seconds", "");
+
+    // Latest value of every field of every sensor that reported at least one observation
+    size_t sensors = metrics_.Sensors();
+    string name, label;
+
+    for (int field = -1; field < History::FIELD_MAX; field++) {
+      name = "tempest_sensor_";
+      name += (field < 0)? "timestamp_seconds": History::Name((History::Field)field);
+
+      if (field < 0) Exposition::Family(text, name, "gauge", "Time of the last observation.");
+      else Exposition::Family(text, name, "gauge", "Last observed value.");
+
+      for (size_t idx = 0; idx < sensors; idx++) {
+        const Metrics::Sensor& sensor = metrics_[idx];
+        int64_t timestamp = sensor.timestamp.load(memory_order_acquire);
+
+        if (!timestamp || (field >= 0 && !(sensor.fields & (1 << field)))) continue;
+
+        label = Exposition::Label("hub", sensor.hub) + ',' + Exposition::Label("sensor", sensor.id);
+        Exposition::Sample(text, name, label, (field < 0)? timestamp: sensor.value[field].load(memory_order_relaxed));
+      }
+    }
+
+    if (http_.Destinations()) http_.Expose(text);
+    if (Publishing()) mqtt_.Expose(text);
+
+    const LogCounters& log = Log::Counters();
+
+    Exposition::Family(text, "tempest_log_records_total", "counter", "Log records written by the background writer.");
+    Exposition::Sample(text, "tempest_log_records_total", "", log.records.load(memory_order_relaxed));
+    Exposition::Family(text, "tempest_log_dropped_total", "counter", "Log records dropped because a thread's ring was full.");
+    Exposition::Sample(text, "tempest_log_dropped_total", "", log.dropped.load(memory_order_relaxed));
+  }
+
+  static void Signal(int event) {
+    uint64_t signal = 1;
+    if (write(event, &signal, sizeof(signal)) == -1) {}
+  }
+
   void Exit(bool notify_parent = false, bool notify_transmitter = false) {
 
     exit_ = true;
 
+    // Wake up the receiver(s) and decoder(s): the event is never consumed so it stays signaled
+    if (exit_event_ != -1) Signal(exit_event_);
+
     if (notify_transmitter) {
       // Wake up the transmitter if he's sleeping
-      scoped_lock<mutex> lock{tempest_access_};
+      scoped_lock<mutex> lock{transmitter_access_};
 
       transmitter_.notify_one();
+      http_.Wakeup();
     }
 
     if (notify_parent) {
@@ -260,44 +1063,180 @@ private:
 
   inline bool Continue(void) { return (!exit_); }
 
-  size_t Write(Log& log, const char data[], size_t data_len) {
+  int Timeout(void) {
     //
-    // Return the number of events/observation written to tempest
-    // or 0 if error/debug/unrecognized
+    // Return how long the transmitter can wait for network activity in Perform(): until the next read is due or the
+    // first spooled payload can be retried, whichever comes first. Decoders and Exit() interrupt it with Wakeup()
     //
-    scoped_lock<mutex> lock{tempest_access_};
+    int retry = http_.Retry();
+    scoped_lock<mutex> lock{transmitter_access_};
 
-    bool notify = false;
+    if (transmitter_notify_ || !Continue()) return (0);
 
-    size_t event = WriteUdp(log, data, data_len, notify);
+    int timeout = max<int64_t>(0, chrono::duration_cast<chrono::milliseconds>(transmitter_deadline_ - chrono::steady_clock::now()).count() + 1);
+
+    return ((retry >= 0)? min(timeout, retry): timeout);
+  }
+
+  size_t Read(Log& log, vector<string> data[FORMAT_MAX], bool wait = true) {
+    //
+    // Return the number of events/observation read from tempest
+    // or 0 if error or (when not waiting) if there is nothing new yet
+    //
+    {
+      unique_lock<mutex> lock{transmitter_access_};
+      auto ready = [this] { return (transmitter_notify_ || !Continue()); };
 
-    // wake up the transmitter if he's sleeping
-    if (notify) transmitter_.notify_one();
+      if (wait) transmitter_.wait_until(lock, transmitter_deadline_, ready);
+      else if (!ready() && chrono::steady_clock::now() < transmitter_deadline_) return (0);
+
+      transmitter_notify_ = false;
+      transmitter_deadline_ = chrono::steady_clock::now() + chrono::seconds(interval_);
+    }
+
+    size_t event = 0;
+
+    for (auto& shard: shard_) {
+      scoped_lock<mutex> lock{shard->tempest_access_};
+
+      shard->tempest_.UpdateStale(log);
+
+      if (read_[FORMAT_ECOWITT]) event += shard->tempest_.ReadEcowitt(log, data[FORMAT_ECOWITT]);
+      if (read_[FORMAT_WEATHERFLOW]) event += shard->tempest_.ReadWeatherFlow(log, data[FORMAT_WEATHERFLOW]);
+      if (read_[FORMAT_INFLUX]) {
+        event += shard->tempest_.ReadInflux(log, data[FORMAT_INFLUX]);
+        shard->influx_read_ = shard->tempest_.Observations();
+      }
+    }
 
     return (event);
   }
 
-  size_t Read(Log& log, vector<string>& data) {
+  struct Batch {
+    enum Framing {
+      NONE = 0,                                                 // one request per sensor
+      NDJSON,                                                   // one JSON object per line
+      ARRAY                                                     // [ object, ... ]
+    };
+
+    Framing framing = NONE;
+    bool hub = false;                                           // one request per hub instead of one for everything
+    size_t lines = 0;                                           // line protocol: max observations per request (0: no limit)
+  };
+
+  void Post(const vector<string> payload[FORMAT_MAX]) {
     //
-    // Return the number of events/observation read from tempest
-    // or 0 if error
+    // Queue the payloads for every destination in its format, batched as configured
     //
-    unique_lock<mutex> lock{tempest_access_};
+    vector<string> ecowitt_json;
+
+    for (size_t idx = 0; idx < batch_.size(); idx++) {
+      const Batch& batch = batch_[idx];
+      const vector<string>& data = payload[format_[idx]];
 
-    transmitter_.wait_for(lock, chrono::seconds(interval_));
-    // == cv_status::timeout
+      if (format_[idx] == FORMAT_INFLUX) {
+        // Line protocol is batched by nature: one write per interval, or per batch.lines observations
+        string body;
+        size_t lines = 0;
 
-    return (ReadEcowitt(log, data));
+        for (size_t event = 0; event < data.size(); event++) {
+          body += data[event];
+          body += '\n';
+
+          if (++lines == batch.lines) {
+            http_.Post(idx, body);
+            body.clear();
+            lines = 0;
+          }
+        }
+
+        if (lines) http_.Post(idx, body);
+        continue;
+      }
+
+      if (batch.framing == Batch::NONE) {
+        for (size_t event = data.size(); event--; ) http_.Post(idx, data[event]);
+        continue;
+      }
+
+      // WeatherFlow documents are JSON already, Ecowitt query strings are converted once for all batched destinations
+      if (format_[idx] == FORMAT_ECOWITT && ecowitt_json.empty()) {
+        ecowitt_json.resize(data.size());
+        for (size_t event = 0; event < data.size(); event++) Ecowitt::Json(data[event], ecowitt_json[event]);
+      }
+
+      const vector<string>& json = (format_[idx] == FORMAT_ECOWITT)? ecowitt_json: data;
+
+      // Request bodies in order of first appearance of each hub (PASSKEY always leads an Ecowitt payload,
+      // a WeatherFlow document is a hub already)
+      vector<pair<string_view, string>> body;
+
+      for (size_t event = 0; event < data.size(); event++) {
+        string_view hub = !batch.hub? string_view{}: (format_[idx] == FORMAT_ECOWITT)? string_view{data[event]}.substr(0, data[event].find('&')): string_view{data[event]};
+        size_t group = 0;
+
+        while (group < body.size() && body[group].first != hub) group++;
+        if (group == body.size()) body.emplace_back(hub, batch.framing == Batch::ARRAY? "[": "");
+
+        string& text = body[group].second;
+
+        if (batch.framing == Batch::ARRAY) {
+          if (text.size() > 1) text += ',';
+          text += json[event];
+        }
+        else {
+          text += json[event];
+          text += '\n';
+        }
+      }
+
+      for (auto& [hub, text]: body) {
+        if (batch.framing == Batch::ARRAY) text += ']';
+        http_.Post(idx, text);
+      }
+    }
   }
 
+  vector<unique_ptr<Shard>> shard_;                             // one codec per receiver
+
   condition_variable transmitter_;
-  mutex tempest_access_;
+  mutex transmitter_access_;
+  bool transmitter_notify_ = false;
+  chrono::steady_clock::time_point transmitter_deadline_;      // next read when not notified earlier
   atomic<bool> exit_{false};
+  int exit_event_;                                              // eventfd signaled at exit
+
+  static constexpr size_t SUBSCRIBE_MAX = 4 * 1024 * 1024;     // max bytes waiting for a subscriber to read them
+
+  mutex subscribe_access_;
+  vector<pair<string, string>> subscribe_;                      // decoder(s) -> controller: topic, payload
+  int subscribe_event_;                                         // eventfd signaled on hand over
+  atomic<int> subscribers_{0};
+
+  mutex publish_access_;
+  vector<pair<string, string>> publish_;                        // decoder(s) -> publisher: topic, payload
+  int publish_event_;                                           // eventfd signaled on hand over
 
   const int buffer_max_;
-  const int io_timeout_;
-  const int port_;
-  const string url_;
+  const int batch_max_;                                         // max datagrams per wakeup
+  const vector<int> ports_;                                     // one socket per port
+  const vector<string> url_;                                    // empty when tracing
+  Http http_;                                                   // one destination per url
+  Mqtt mqtt_;                                                   // disabled if no broker url
+  Metrics metrics_;                                             // lock-free values for the exporter
+  StatsData* stats_ = nullptr;                                  // shared memory statistics, nullptr if not published
+  Feed feed_;                                                   // shared memory conditions, records added by the decoders
+  State state_;                                                 // accumulations of the previous run, read-only
+  string state_path_;                                           // "": not saving
+  Store store_;                                                 // observation history on disk, series added by the decoders
+  string store_dir_;
+  atomic<uint64_t> store_reported_{0};                          // store errors already logged
+  atomic<uint64_t> store_rejected_{0};                          // sensors not stored already logged
+  const int metrics_port_;                                      // 0: not exporting
+  vector<Batch> batch_;                                         // one per url
+  vector<Format> format_;                                       // one per url
+  bool read_[FORMAT_MAX] = {};                                  // formats requested by at least one destination
+  size_t influx_lines_ = 0;                                     // smallest line protocol batch (0: interval only)
   const int interval_;                                          // in seconds
   const Log::Level level_;
   const Log::Facility facility_;
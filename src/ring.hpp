@@ -0,0 +1,130 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: bounded lock-free single-producer/single-consumer ring of fixed-size datagram slots
+//
+
+#ifndef TEMPEST_RING
+#define TEMPEST_RING
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// Producer (receiver):                           Consumer (decoder):
+//
+// size_t free = ring.Free();                     size_t size = ring.Size();
+// for (idx < free) recv into ring.SlotFree(idx)  for (idx < size) decode ring.Slot(idx), ring.Length(idx)
+// ring.SetStamp(idx, now)  (optional)            ring.Stamp(idx)  (receive time, optional)
+// ring.Push(received);                           ring.Pop(size);
+//
+// Slot indexes are relative to the producer head (Free/SlotFree/SetLength/SetStamp/Push) or the consumer tail
+// (Size/Slot/Length/Stamp/Pop)
+// so each side only ever touches slots the other side cannot see
+//
+
+class Ring {
+public:
+
+  Ring(size_t slots, size_t slot_size): slot_size_{slot_size} {
+    // Round up to a power of 2 so we can mask instead of divide
+    size_t capacity = 1;
+    while (capacity < slots) capacity <<= 1;
+
+    mask_ = capacity - 1;
+    buffer_.resize(capacity * slot_size_);
+    length_.resize(capacity);
+    stamp_.resize(capacity);
+  }
+
+  inline size_t Capacity(void) const { return (mask_ + 1); }
+  inline size_t SlotSize(void) const { return (slot_size_); }
+
+  inline size_t Depth(void) const {
+    // Slots in flight, for monitoring from any thread
+    size_t tail = tail_.load(memory_order_acquire);
+    return (head_.load(memory_order_acquire) - tail);
+  }
+
+  // Producer ------------------------------------------------------------------------------------------------------------------
+
+  inline size_t Free(void) const {
+    return (Capacity() - (head_.load(memory_order_relaxed) - tail_.load(memory_order_acquire)));
+  }
+
+  inline char* SlotFree(size_t idx) {
+    return (&buffer_[((head_.load(memory_order_relaxed) + idx) & mask_) * slot_size_]);
+  }
+
+  inline void SetLength(size_t idx, size_t len) {
+    length_[(head_.load(memory_order_relaxed) + idx) & mask_] = len;
+  }
+
+  inline void SetStamp(size_t idx, int64_t stamp) {
+    stamp_[(head_.load(memory_order_relaxed) + idx) & mask_] = stamp;
+  }
+
+  inline void Push(size_t count) {
+    // Publish slot data and lengths to the consumer
+    head_.store(head_.load(memory_order_relaxed) + count, memory_order_release);
+  }
+
+  // Consumer ------------------------------------------------------------------------------------------------------------------
+
+  inline size_t Size(void) const {
+    return (head_.load(memory_order_acquire) - tail_.load(memory_order_relaxed));
+  }
+
+  inline const char* Slot(size_t idx) const {
+    return (&buffer_[((tail_.load(memory_order_relaxed) + idx) & mask_) * slot_size_]);
+  }
+
+  inline size_t Length(size_t idx) const {
+    return (length_[(tail_.load(memory_order_relaxed) + idx) & mask_]);
+  }
+
+  inline int64_t Stamp(size_t idx) const {
+    return (stamp_[(tail_.load(memory_order_relaxed) + idx) & mask_]);
+  }
+
+  inline void Pop(size_t count) {
+    // Give slots back to the producer
+    tail_.store(tail_.load(memory_order_relaxed) + count, memory_order_release);
+  }
+
+private:
+
+  alignas(64) atomic<size_t> head_{0};                          // written by the producer only
+  alignas(64) atomic<size_t> tail_{0};                          // written by the consumer only
+
+  alignas(64) size_t mask_;
+  const size_t slot_size_;
+
+  vector<char> buffer_;                                         // capacity * slot_size_ bytes
+  vector<size_t> length_;                                       // per slot datagram length
+  vector<int64_t> stamp_;                                       // per slot receive time (steady clock ns)
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_RING
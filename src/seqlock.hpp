@@ -0,0 +1,121 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: single writer, lock-free readers synchronization for fixed-layout data, shared memory included
+//
+
+#ifndef TEMPEST_SEQLOCK
+#define TEMPEST_SEQLOCK
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+// Standalone: shared with feed readers built outside the relay, so no system.hpp
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// Seqlock<UdpSnapshot> shared;                                  // anywhere, shared memory included
+//
+// shared.Write([&](UdpSnapshot& data) { ... });                 // single writer, never blocks
+// UdpSnapshot copy;
+// if (shared.Read(copy)) copy.Format(text, time(nullptr));      // any number of readers, in any process
+// shared.Peek([&](const UdpSnapshot& data) { ... });            // same without the copy: data may be torn until
+//                                                               // Peek() returns true, so only copy values out of it
+//
+// The sequence is odd while a write is in progress: readers copy the data and retry if the sequence moved under
+// them. A reader gives up (returns false) rather than spinning forever on a writer that died mid-update
+//
+
+template<typename T>
+class Seqlock {
+public:
+
+  static_assert(is_trivially_copyable<T>::value, "Seqlock data must be trivially copyable");
+  static_assert(atomic<uint32_t>::is_always_lock_free, "Seqlock sequence must be lock-free to be shared across processes");
+
+  template<typename F>
+  void Write(const F& fill) {
+    uint32_t sequence = sequence_.load(memory_order_relaxed);
+
+    sequence_.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    fill(data_);
+
+    sequence_.store(sequence + 2, memory_order_release);
+  }
+
+  bool Read(T& data, int retry = 100000) const {
+    while (retry--) {
+      uint32_t sequence = sequence_.load(memory_order_acquire);
+
+      if (sequence & 1) {
+        this_thread::yield();
+        continue;
+      }
+
+      memcpy(&data, (const void*)&data_, sizeof(T));
+      atomic_thread_fence(memory_order_acquire);
+
+      if (sequence_.load(memory_order_relaxed) == sequence) return (true);
+    }
+
+    return (false);
+  }
+
+  template<typename F>
+  bool Peek(const F& visit, int retry = 100000) const {
+    while (retry--) {
+      uint32_t sequence = sequence_.load(memory_order_acquire);
+
+      if (sequence & 1) {
+        this_thread::yield();
+        continue;
+      }
+
+      visit((const T&)data_);
+      atomic_thread_fence(memory_order_acquire);
+
+      if (sequence_.load(memory_order_relaxed) == sequence) return (true);
+    }
+
+    return (false);
+  }
+
+  inline uint32_t Generation(void) const {
+    // Completed writes so far: readers poll it to skip unchanged data
+    return (sequence_.load(memory_order_acquire) >> 1);
+  }
+
+private:
+
+  atomic<uint32_t> sequence_{0};
+  T data_;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_SEQLOCK
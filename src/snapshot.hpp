@@ -0,0 +1,260 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: fixed-layout relay statistics published to shared memory under seqlocks
+//
+
+#ifndef TEMPEST_SNAPSHOT
+#define TEMPEST_SNAPSHOT
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "log.hpp"
+#include "udp.hpp"
+#include "seqlock.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+class Snapshot {
+public:
+
+  static void Copy(char* text, size_t size, string_view value) {
+    // Truncate to fit and always terminate
+    size = min(value.size(), size - 1);
+
+    memcpy(text, value.data(), size);
+    text[size] = '\0';
+  }
+
+  static void Uptime(ostream& stats, time_t start, time_t now) {
+    time_t uptime = max<time_t>(now - start, 0);
+
+    stats << "Uptime: " << (uptime / 86400) << "d." << (uptime % 86400 / 3600) << "h." << (uptime % 3600 / 60) << "m." << (uptime % 60) << "s" << endl;
+  }
+};
+
+//
+// Statistics of one receiver shard (written by its decoder)
+//
+
+struct UdpSnapshot {
+  static constexpr size_t HUB_MAX = 16;
+  static constexpr size_t SENSOR_MAX = 64;
+
+  time_t start_time;
+  time_t stale;                                                 // seconds without changes before a sensor is stale
+  uint64_t wakeups;
+  uint64_t datagrams;
+  uint64_t overflows;
+  uint64_t events[UDP_EVENT_MAX];
+
+  uint32_t hubs;                                                // in hub[], up to HUB_MAX
+  uint32_t sensors;                                             // in sensor[], up to SENSOR_MAX, grouped by hub
+
+  struct {
+    char id[24];
+    int version;
+    uint64_t status;
+    uint32_t sensors;                                           // in sensor[] for this hub
+  }
+  hub[HUB_MAX];
+
+  struct {
+    char id[24];
+    int version;
+    time_t updated;
+    uint64_t precipitation;
+    uint64_t lightning;
+    uint64_t wind;
+    uint64_t observation;
+    uint64_t status;
+    uint32_t history;
+    uint32_t capacity;
+  }
+  sensor[SENSOR_MAX];
+
+  inline bool Stale(size_t idx, time_t now) const {
+    return (stale && now - sensor[idx].updated >= stale);
+  }
+
+  void Format(ostream& stats, time_t now) const {
+    size_t count = 0;
+
+    Snapshot::Uptime(stats, start_time, now);
+    stats << "Datagrams: " << datagrams << endl;
+    stats << "Datagrams per Wakeup: " << fixed << setprecision(2) << (wakeups? ((double)datagrams / wakeups): 0) << defaultfloat << endl;
+    stats << "Datagrams Overflowed: " << overflows << endl;
+    stats << "Invalid Events: " << events[UDP_INVALID] << endl;
+    stats << "Debug Events: " << events[UDP_DEBUG] << endl;
+    stats << "Unknown Events: " << events[UDP_UNKNOWN] << endl;
+    for (int id = 0; id < UDP_DEBUG; id++) stats << "Events (" << UdpMessage::Tag((UdpEvent)id) << "): " << events[id] << endl;
+    for (size_t idx = 0; idx < sensors; idx++) count += Stale(idx, now);
+    stats << "Stale Sensors: " << count << endl;
+    stats << "Hubs: " << hubs << endl;
+
+    size_t idx = 0;
+
+    for (size_t i = 0; i < hubs; i++) {
+      stats << "[" << i << "]: " << hub[i].id << " " << hub[i].version << endl;
+      stats << "     Status Events: " << hub[i].status << endl;
+      stats << "     Sensors: " << hub[i].sensors << endl;
+      for (size_t j = 0; j < hub[i].sensors; j++, idx++) {
+        stats << "     [" << j << "]: " << sensor[idx].id << " " << sensor[idx].version << (Stale(idx, now)? " (stale)": "") << endl;
+        stats << "          Last Update: " << (now - sensor[idx].updated) << "s ago" << endl;
+        stats << "          Rain Start Events: " << sensor[idx].precipitation << endl;
+        stats << "          Lightning Strike Events: " << sensor[idx].lightning << endl;
+        stats << "          Rapid wind Events: " << sensor[idx].wind << endl;
+        stats << "          Observation Events: " << sensor[idx].observation << endl;
+        stats << "          Status Events: " << sensor[idx].status << endl;
+        stats << "          History: " << sensor[idx].history << "/" << sensor[idx].capacity << endl;
+      }
+    }
+  }
+};
+
+//
+// Statistics of the HTTP destinations (written by the transmitter)
+//
+
+struct HttpSnapshot {
+  static constexpr size_t DESTINATION_MAX = 16;
+
+  uint32_t destinations;                                        // total, only the first DESTINATION_MAX are detailed
+
+  struct {
+    char url[256];
+    uint64_t inflight;
+    uint64_t queued;
+    uint64_t sent;
+    uint64_t errors;
+    uint64_t dropped;
+    uint64_t latency_sum;                                       // microseconds
+    uint64_t latency_max;
+    uint64_t spooled;
+    time_t spool_oldest;
+    time_t retry;                                               // wall clock of the next retry, 0 if healthy
+  }
+  destination[DESTINATION_MAX];
+
+  void Format(ostream& stats, time_t now) const {
+    stats << "Destinations: " << destinations << endl;
+    for (size_t idx = 0; idx < destinations && idx < DESTINATION_MAX; idx++) {
+      const auto& ds = destination[idx];
+
+      stats << "[" << idx << "]: " << ds.url << endl;
+      stats << "     In Flight: " << ds.inflight << endl;
+      stats << "     Queued: " << ds.queued << endl;
+      stats << "     Sent: " << ds.sent << endl;
+      stats << "     Errors: " << ds.errors << endl;
+      stats << "     Dropped: " << ds.dropped << endl;
+      stats << "     Spooled: " << ds.spooled;
+      if (ds.spooled) stats << " (oldest " << (now - ds.spool_oldest) << "s ago)";
+      stats << endl;
+      if (ds.retry) stats << "     Retry In: " << max<time_t>(ds.retry - now, 0) << "s" << endl;
+      stats << "     Latency (avg/max): " << fixed << setprecision(1) << (ds.sent? (ds.latency_sum / 1000.0 / ds.sent): 0) << "ms / " << (ds.latency_max / 1000.0) << "ms" << defaultfloat << endl;
+    }
+  }
+};
+
+//
+// Statistics of the MQTT broker connection (written by the publisher)
+//
+
+struct MqttSnapshot {
+  char host[256];
+  char port[8];
+  char prefix[128];
+  int qos;
+  bool connected;
+  uint64_t connects;
+  uint64_t published;
+  uint64_t acked;
+  uint64_t inflight;
+  uint64_t queued;
+  uint64_t dropped;
+
+  void Format(ostream& stats) const {
+    stats << "MQTT: " << host << ":" << port << "/" << prefix << " (QoS " << qos << ")" << endl;
+    stats << "     Connected: " << (connected? "yes": "no") << endl;
+    stats << "     Connects: " << connects << endl;
+    stats << "     Published: " << published << endl;
+    stats << "     Acknowledged: " << acked << endl;
+    stats << "     In Flight: " << inflight << endl;
+    stats << "     Queued: " << queued << endl;
+    stats << "     Dropped: " << dropped << endl;
+  }
+};
+
+//
+// Everything --stats prints, laid out for the shared memory segment: each section has a single writer
+//
+
+struct StatsData {
+  static constexpr size_t RECEIVER_MAX = 16;
+
+  atomic<pid_t> pid;                                            // relay publishing, 0 if none
+  uint32_t receivers;
+  bool http;                                                    // at least one destination
+  bool mqtt;                                                    // publishing
+
+  Seqlock<UdpSnapshot> udp[RECEIVER_MAX];
+  Seqlock<HttpSnapshot> destinations;
+  Seqlock<MqttSnapshot> broker;
+  LogCounters log;                                              // updated in place by the log writer
+
+  bool Format(string& text) const {
+    //
+    // Snapshot every section and format them: return false if a writer held a section for too long
+    //
+    ostringstream stats{""};
+    time_t now = time(nullptr);
+
+    unique_ptr<UdpSnapshot> udp_copy{new UdpSnapshot};
+    for (size_t idx = 0; idx < receivers && idx < RECEIVER_MAX; idx++) {
+      if (!udp[idx].Read(*udp_copy)) return (false);
+
+      if (receivers > 1) stats << "Receiver [" << idx << "]:" << endl;
+      udp_copy->Format(stats, now);
+    }
+
+    if (http) {
+      unique_ptr<HttpSnapshot> http_copy{new HttpSnapshot};
+      if (!destinations.Read(*http_copy)) return (false);
+      http_copy->Format(stats, now);
+    }
+
+    if (mqtt) {
+      MqttSnapshot mqtt_copy;
+      if (!broker.Read(mqtt_copy)) return (false);
+      mqtt_copy.Format(stats);
+    }
+
+    stats << "Log Records: " << log.records.load(memory_order_relaxed) << endl;
+    stats << "Log Records Dropped: " << log.dropped.load(memory_order_relaxed) << endl;
+
+    text = stats.str();
+
+    return (true);
+  }
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_SNAPSHOT
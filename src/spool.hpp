@@ -0,0 +1,386 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: bounded FIFO of undelivered payloads, on disk (append-only segment files + read index) or in memory
+//
+
+#ifndef TEMPEST_SPOOL
+#define TEMPEST_SPOOL
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "log.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage (single thread):
+//
+// Spool spool{"/var/spool/tempest/hubitat"};                   // "" keeps payloads in memory only
+//
+// spool.Open(log);
+// spool.Push(log, payload, time(nullptr));
+// if (spool.Front(payload)) { if (delivered) spool.Pop(log); }
+//
+// On disk a directory holds <16 hex digits>.seg segment files of [Record][payload] entries, appended to the newest
+// segment only, and an index file with the read position. Fully consumed segments are unlinked; when the spool
+// exceeds bytes_max the oldest segment is dropped as a whole. A torn record at the tail (crash while appending) is
+// truncated away on Open()
+//
+
+class Spool {
+public:
+
+  Spool(const string& dir, size_t bytes_max = 64 << 20, size_t segment_max = 1 << 20): dir_{dir}, bytes_max_{bytes_max}, segment_max_{segment_max} {}
+
+  ~Spool() {
+    Close();
+  }
+
+  inline bool Disk(void) const { return (!dir_.empty()); }
+  inline size_t Size(void) const { return (entries_); }
+  inline size_t Bytes(void) const { return (bytes_); }
+  inline uint64_t Dropped(void) const { return (dropped_); }
+  inline uint64_t FrontId(void) const { return (removed_); }   // changes whenever the front entry is popped or dropped
+
+  inline time_t Oldest(void) const {
+    // Timestamp of the oldest entry or 0 if empty
+    return (entries_? front_time_: 0);
+  }
+
+  void Open(Log& log) {
+    if (!Disk()) return;
+
+    if (mkdir(dir_.c_str(), 0750) == -1 && errno != EEXIST) {
+      TLOG_ERROR(log) << "mkdir(" << dir_ << ") failed: " << strerror(errno) << "." << endl;
+      throw runtime_error("mkdir()");
+    }
+
+    // Existing segments, oldest first
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir) {
+      TLOG_ERROR(log) << "opendir(" << dir_ << ") failed: " << strerror(errno) << "." << endl;
+      throw runtime_error("opendir()");
+    }
+
+    vector<uint64_t> ids;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+      const char* name = entry->d_name;
+      uint64_t id;
+      if (strlen(name) == 20 && !strcmp(name + 16, ".seg") && from_chars(name, name + 16, id, 16).ptr == name + 16) ids.push_back(id);
+    }
+    closedir(dir);
+    sort(ids.begin(), ids.end());
+
+    // Read position
+    Index index{INDEX_MAGIC, ids.empty()? 0: ids.front(), 0};
+
+    index_fd_ = open((dir_ + "/index").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (index_fd_ == -1) {
+      TLOG_ERROR(log) << "open(" << dir_ << "/index) failed: " << strerror(errno) << "." << endl;
+      throw runtime_error("open()");
+    }
+
+    Index stored;
+    if (pread(index_fd_, &stored, sizeof(stored), 0) == sizeof(stored) && stored.magic == INDEX_MAGIC) index = stored;
+
+    // Rebuild the in-memory accounting from the read position onwards
+    for (uint64_t id: ids) {
+      if (id < index.segment) {
+        // Consumed before a crash but not yet unlinked
+        unlink(SegmentPath(id).c_str());
+        continue;
+      }
+
+      Segment segment{id, -1, 0, 0, 0};
+      segment.fd = open(SegmentPath(id).c_str(), O_RDWR | O_CLOEXEC);
+      if (segment.fd == -1) continue;
+
+      off_t offset = 0, end = lseek(segment.fd, 0, SEEK_END);
+      Record record;
+      while (offset + (off_t)sizeof(record) <= end && pread(segment.fd, &record, sizeof(record), offset) == sizeof(record) && record.magic == RECORD_MAGIC && offset + (off_t)sizeof(record) + record.length <= end) {
+        if (id > index.segment || offset >= (off_t)index.offset) {
+          segment.entries++;
+          segment.bytes += sizeof(record) + record.length;
+        }
+        offset += sizeof(record) + record.length;
+      }
+
+      if (offset < end) {
+        TLOG_WARNING(log) << "Spool " << SegmentPath(id) << " truncated at " << offset << " (torn record)." << endl;
+        if (ftruncate(segment.fd, offset) == -1) {}
+      }
+      segment.size = offset;
+
+      entries_ += segment.entries;
+      bytes_ += segment.bytes;
+      segment_.push_back(segment);
+    }
+
+    if (segment_.empty()) Rotate(log);
+    if (segment_.front().id != index.segment) index = Index{INDEX_MAGIC, segment_.front().id, 0};
+
+    read_offset_ = index.offset;
+    SaveIndex();
+
+    if (entries_) Load(log);
+  }
+
+  void Close(void) {
+    for (Segment& segment: segment_) if (segment.fd != -1) close(segment.fd);
+    segment_.clear();
+
+    if (index_fd_ != -1) {
+      close(index_fd_);
+      index_fd_ = -1;
+    }
+  }
+
+  void Push(Log& log, string_view payload, time_t timestamp) {
+    if (!Disk()) {
+      if (memory_.size() >= memory_max_) Drop(log);
+
+      memory_.emplace_back(timestamp, string{payload});
+      bytes_ += payload.size();
+      if (!entries_++) front_time_ = timestamp;
+      return;
+    }
+
+    Record record{RECORD_MAGIC, (uint32_t)payload.size(), timestamp};
+    size_t size = sizeof(record) + payload.size();
+
+    // Stay within bounds by dropping the oldest segment(s), but never the one being written
+    while (bytes_ + size > bytes_max_ && segment_.size() > 1) Drop(log);
+
+    if (segment_.back().size + size > segment_max_ && segment_.back().size) Rotate(log);
+
+    Segment& segment = segment_.back();
+
+    struct iovec iov[2] = {{&record, sizeof(record)}, {(void*)payload.data(), payload.size()}};
+    if (pwritev(segment.fd, iov, 2, segment.size) != (ssize_t)size) {
+      TLOG_ERROR(log) << "Spool write to " << SegmentPath(segment.id) << " failed: " << strerror(errno) << "." << endl;
+      if (ftruncate(segment.fd, segment.size) == -1) {}
+      dropped_++;
+      return;
+    }
+
+    segment.size += size;
+    segment.entries++;
+    segment.bytes += size;
+    bytes_ += size;
+
+    if (!entries_++) Load(log);
+  }
+
+  bool Front(string& payload) {
+    //
+    // Copy the oldest entry into payload: return false if the spool is empty
+    //
+    if (!entries_) return (false);
+
+    if (!Disk()) payload = memory_.front().second;
+    else payload = front_;
+
+    return (true);
+  }
+
+  void Pop(Log& log) {
+    if (!entries_) return;
+
+    removed_++;
+
+    if (!Disk()) {
+      bytes_ -= memory_.front().second.size();
+      memory_.pop_front();
+      if (--entries_) front_time_ = memory_.front().first;
+      return;
+    }
+
+    Segment& segment = segment_.front();
+    size_t size = sizeof(Record) + front_length_;
+
+    read_offset_ += size;
+    segment.entries--;
+    segment.bytes -= size;
+    entries_--;
+    bytes_ -= size;
+
+    // Move on to the next segment once this one is consumed and no longer written to
+    if (!segment.entries && segment_.size() > 1) Unlink();
+
+    SaveIndex();
+
+    if (entries_) Load(log);
+  }
+
+private:
+
+  static constexpr uint32_t RECORD_MAGIC = 0x54505352;        // "TPSR"
+  static constexpr uint32_t INDEX_MAGIC = 0x54505349;         // "TPSI"
+
+  struct Record {
+    uint32_t magic;
+    uint32_t length;
+    int64_t timestamp;
+  };
+
+  struct Index {
+    uint32_t magic;
+    uint64_t segment;                                           // segment being read
+    uint64_t offset;                                            // next record in it
+  };
+
+  struct Segment {
+    uint64_t id;
+    int fd;
+    off_t size;                                                 // file size
+    size_t entries;                                             // unread entries
+    size_t bytes;                                               // unread bytes
+  };
+
+  string SegmentPath(uint64_t id) const {
+    char name[24];
+    snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)id);
+    return (dir_ + name);
+  }
+
+  void Rotate(Log& log) {
+    uint64_t id = segment_.empty()? 0: segment_.back().id + 1;
+
+    int fd = open(SegmentPath(id).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd == -1) {
+      TLOG_ERROR(log) << "open(" << SegmentPath(id) << ") failed: " << strerror(errno) << "." << endl;
+      throw runtime_error("open()");
+    }
+
+    segment_.push_back(Segment{id, fd, 0, 0, 0});
+
+    // The previous segment may have been fully consumed while it was still the write segment
+    if (segment_.size() > 1 && !segment_.front().entries) {
+      Unlink();
+      SaveIndex();
+    }
+  }
+
+  void Unlink(void) {
+    Segment& segment = segment_.front();
+
+    close(segment.fd);
+    unlink(SegmentPath(segment.id).c_str());
+    segment_.pop_front();
+
+    read_offset_ = 0;
+  }
+
+  void Drop(Log& log) {
+    //
+    // Make room by discarding the oldest entries: one entry in memory, a whole segment on disk
+    //
+    if (!Disk()) {
+      dropped_++;
+      Pop(log);
+      return;
+    }
+
+    Segment& segment = segment_.front();
+
+    TLOG_WARNING(log) << "Spool " << dir_ << " full: dropping " << segment.entries << " oldest entries." << endl;
+
+    dropped_ += segment.entries;
+    removed_ += segment.entries;
+    entries_ -= segment.entries;
+    bytes_ -= segment.bytes;
+
+    Unlink();
+    SaveIndex();
+
+    if (entries_) Load(log);
+  }
+
+  void SaveIndex(void) {
+    Index index{INDEX_MAGIC, segment_.front().id, (uint64_t)read_offset_};
+    if (pwrite(index_fd_, &index, sizeof(index), 0) == -1) {}
+  }
+
+  void Load(Log& log) {
+    //
+    // Cache the entry at the read position, skipping consumed segments
+    //
+    while (!segment_.front().entries && segment_.size() > 1) Unlink();
+
+    Segment& segment = segment_.front();
+    Record record;
+
+    if (pread(segment.fd, &record, sizeof(record), read_offset_) != sizeof(record) || record.magic != RECORD_MAGIC) {
+      TLOG_ERROR(log) << "Spool " << SegmentPath(segment.id) << " corrupted at " << read_offset_ << ": skipping segment." << endl;
+
+      dropped_ += segment.entries;
+      removed_ += segment.entries;
+      entries_ -= segment.entries;
+      bytes_ -= segment.bytes;
+      segment.entries = 0;
+      segment.bytes = 0;
+
+      if (segment_.size() > 1) Unlink();
+      else read_offset_ = segment.size;
+      SaveIndex();
+
+      if (entries_) Load(log);
+      return;
+    }
+
+    front_length_ = record.length;
+    front_time_ = record.timestamp;
+    front_.resize(record.length);
+
+    ssize_t read = pread(segment.fd, front_.data(), record.length, read_offset_ + sizeof(record));
+    if (read != record.length) {
+      // An empty or partial payload must not be delivered in place of the real one: drop the entry
+      TLOG_ERROR(log) << "Spool read from " << SegmentPath(segment.id) << " at " << read_offset_ << " failed: " << ((read == -1)? strerror(errno): "short read") << ": entry dropped." << endl;
+      dropped_++;
+      Pop(log);
+    }
+  }
+
+  const string dir_;
+  const size_t bytes_max_;
+  const size_t segment_max_;
+  const size_t memory_max_ = 1024;                              // entries kept when not on disk
+
+  deque<Segment> segment_;                                      // oldest (being read) first, newest (being written) last
+  int index_fd_ = -1;
+  off_t read_offset_ = 0;
+
+  deque<pair<time_t, string>> memory_;
+
+  size_t entries_ = 0;
+  size_t bytes_ = 0;
+  uint64_t dropped_ = 0;
+  uint64_t removed_ = 0;                                        // entries popped or dropped so far
+
+  string front_;                                                // cached oldest payload
+  size_t front_length_ = 0;
+  time_t front_time_ = 0;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_SPOOL
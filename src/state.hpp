@@ -0,0 +1,218 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: sensor accumulations saved across restarts
+//
+
+#ifndef TEMPEST_STATE
+#define TEMPEST_STATE
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "snapshot.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+#define TEMPEST_STATE_MAGIC     0x41545354                      // "TSTA"
+#define TEMPEST_STATE_VERSION   1                               // bump on any layout change
+
+using namespace std;
+
+//
+// What a sensor can't rebuild from the next observation: plain fixed-width fields so the file layout doesn't depend
+// on the codec internals
+//
+
+struct StateRecord {
+  char hub[24];
+  char sensor[24];
+
+  struct {
+    int32_t year;                                               // struct tm of the last observation, UTC
+    int32_t month;
+    int32_t yday;
+    int32_t wday;
+    int32_t hour;
+  }
+  track;
+
+  double precip_rate;                                           // mm/h
+  double precip_event;                                          // mm
+  double precip_hourly;                                         // mm
+  double precip_daily;                                          // mm
+  double precip_weekly;                                         // mm
+  double precip_monthly;                                        // mm
+  double precip_yearly;                                         // mm
+  double precip_total;                                          // mm
+
+  double wind_direction;
+  double wind_direction_avg10m;
+  double wind_speed;
+  double wind_speed_avg10m;
+  double wind_gust;
+  double wind_gust_daily;
+
+  double wind_sample[2][10];                                    // 10m wind direction and speed samples
+  int32_t wind_index;
+  int32_t reserved;
+};
+
+struct StateHeader {
+  uint32_t magic;                                               // TEMPEST_STATE_MAGIC
+  uint32_t version;                                             // TEMPEST_STATE_VERSION
+  uint32_t record_size;                                         // sizeof(StateRecord)
+  uint32_t records;
+  int64_t saved;                                                // wall clock
+};
+
+//
+// Usage:
+//
+// State state;
+//
+// state.Load("/var/lib/tempest/state");                         // once, before the decoders start
+// const StateRecord* record = state.Find(sensor);              // any decoder, nullptr if not saved
+//
+// vector<StateRecord> records;                                  // every sensor of every shard...
+// state.Save("/var/lib/tempest/state", records);                // ...and the saved ones not seen since
+//
+// The file is replaced atomically (written aside, synced and renamed over), so a crash mid-save leaves the previous
+// snapshot intact. Find() is lock-free: the loaded records are never modified after Load()
+//
+
+class State {
+public:
+
+  error_t Load(const string& path) {
+    //
+    // Map the snapshot and index its records
+    // Return ENOENT if there is none, EPROTO if it was written by an incompatible version or is truncated
+    //
+    error_t err = 0;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) return (errno);
+
+    if (fstat(fd, &st) == -1) err = errno;
+    else if ((size_t)st.st_size < sizeof(StateHeader)) err = EPROTO;
+    else {
+      void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (addr == MAP_FAILED) err = errno;
+      else {
+        const StateHeader& header = *(const StateHeader*)addr;
+        const StateRecord* record = (const StateRecord*)((const char*)addr + sizeof(StateHeader));
+
+        if (header.magic != TEMPEST_STATE_MAGIC || header.version != TEMPEST_STATE_VERSION || header.record_size != sizeof(StateRecord) ||
+            (size_t)st.st_size != sizeof(StateHeader) + (size_t)header.records * sizeof(StateRecord)) err = EPROTO;
+        else {
+          saved_ = header.saved;
+
+          for (uint32_t idx = 0; idx < header.records; idx++) record_.emplace(Sensor(record[idx]), record[idx]);
+        }
+
+        munmap(addr, st.st_size);
+      }
+    }
+
+    close(fd);
+
+    return (err);
+  }
+
+  inline const StateRecord* Find(string_view sensor) const {
+    auto it = record_.find(string{sensor});
+    return ((it == record_.end())? nullptr: &it->second);
+  }
+
+  inline size_t Size(void) const { return (record_.size()); }
+  inline time_t Saved(void) const { return (saved_); }
+
+  error_t Save(const string& path, vector<StateRecord>& records) const {
+    //
+    // Replace the snapshot with records plus the loaded records of sensors not in records (not heard from since)
+    //
+    error_t err = 0;
+    string temp = path + ".tmp";
+    int fd;
+
+    unordered_map<string, bool> current;
+    for (const StateRecord& record: records) current[string{Sensor(record)}] = true;
+    for (const auto& [sensor, record]: record_) if (!current.count(sensor)) records.push_back(record);
+
+    StateHeader header;
+    header.magic = TEMPEST_STATE_MAGIC;
+    header.version = TEMPEST_STATE_VERSION;
+    header.record_size = sizeof(StateRecord);
+    header.records = records.size();
+    header.saved = time(nullptr);
+
+    if ((fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1) return (errno);
+
+    if (!(err = Write(fd, &header, sizeof(header))) && !(err = Write(fd, records.data(), records.size() * sizeof(StateRecord)))) {
+      if (fsync(fd) == -1) err = errno;
+    }
+
+    if (close(fd) == -1 && !err) err = errno;
+
+    if (!err && rename(temp.c_str(), path.c_str()) == -1) err = errno;
+    if (err) unlink(temp.c_str());
+
+    // The rename is only durable once the directory entry is on disk too
+    if (!err) {
+      size_t slash = path.rfind('/');
+      string dir = (slash == string::npos)? ".": (slash? path.substr(0, slash): "/");
+
+      if ((fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) err = errno;
+      else {
+        if (fsync(fd) == -1) err = errno;
+        close(fd);
+      }
+    }
+
+    return (err);
+  }
+
+private:
+
+  static inline string_view Sensor(const StateRecord& record) {
+    return (string_view{record.sensor, strnlen(record.sensor, sizeof(record.sensor))});
+  }
+
+  static error_t Write(int fd, const void* data, size_t size) {
+    for (size_t done = 0; done < size; ) {
+      ssize_t len = write(fd, (const char*)data + done, size - done);
+
+      if (len == -1) {
+        if (errno == EINTR) continue;
+        return (errno);
+      }
+      done += len;
+    }
+
+    return (0);
+  }
+
+  unordered_map<string, StateRecord> record_;                   // by sensor serial number, read-only after Load()
+  time_t saved_ = 0;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_STATE
@@ -0,0 +1,619 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: append-only columnar store of the observations received, compressed Gorilla style
+// Inspired by: http://www.vldb.org/pvldb/vol8/p1816-teller.pdf
+//
+
+#ifndef TEMPEST_STORE
+#define TEMPEST_STORE
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+#include "snapshot.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+#define TEMPEST_STORE_MAGIC     0x53545354                      // "TSTS"
+#define TEMPEST_STORE_BLOCK     0x4b4c4253                      // "SBLK"
+#define TEMPEST_STORE_VERSION   1                               // bump on any layout change
+
+using namespace std;
+
+//
+// Segment file: one per sensor and month, <dir>/<sensor>-<yyyymm>.tss
+//
+// <StoreHeader> <block> <block> ...
+//
+// block: <StoreBlock> <timestamp column> <field 0 column> ... <field n - 1 column>
+//
+// Timestamps: the first in the block header, then the delta of the delta from the previous one, zigzag encoded in
+// '0' (same interval, the usual case: 1 bit), '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits or '1111' + 64 bits
+//
+// Values: the first as is (64 bits), then XORed with the previous one: '0' if equal, '10' + the meaningful bits if
+// they fit in the previous window of leading/trailing zeros, '11' + 5 bits leading zeros + 6 bits length - 1 + the
+// meaningful bits otherwise. Columns are byte aligned
+//
+
+struct StoreHeader {
+  uint32_t magic;                                               // TEMPEST_STORE_MAGIC
+  uint32_t version;                                             // TEMPEST_STORE_VERSION
+  uint32_t fields;                                              // columns per block after the timestamps
+  uint32_t block_size;                                          // sizeof(StoreBlock)
+  char hub[24];
+  char sensor[24];
+  char names[256];                                              // comma separated field names
+};
+
+struct StoreBlock {
+  static constexpr size_t FIELD_MAX = 16;
+
+  uint32_t magic;                                               // TEMPEST_STORE_BLOCK
+  uint32_t count;                                               // observations
+  int64_t first;                                                // timestamp of the first observation
+  int64_t last;                                                 // ... and of the last
+  uint32_t size[1 + FIELD_MAX];                                 // bytes of the timestamp column, then of each field
+
+  inline size_t Bytes(uint32_t fields) const {
+    size_t bytes = 0;
+    for (uint32_t idx = 0; idx <= fields && idx <= FIELD_MAX; idx++) bytes += size[idx];
+    return (bytes);
+  }
+};
+
+class BitWriter {
+public:
+
+  BitWriter(string& out): out_{out} {}
+
+  void Put(uint64_t value, int bits) {
+    // Most significant bit first
+    while (bits) {
+      int room = 8 - used_;
+      int take = min(room, bits);
+
+      byte_ |= ((value >> (bits - take)) & ((1u << take) - 1)) << (room - take);
+      used_ += take;
+      bits -= take;
+
+      if (used_ == 8) {
+        out_ += (char)byte_;
+        byte_ = 0;
+        used_ = 0;
+      }
+    }
+  }
+
+  void Finish(void) {
+    if (used_) out_ += (char)byte_;
+    byte_ = 0;
+    used_ = 0;
+  }
+
+private:
+
+  string& out_;
+  uint8_t byte_ = 0;
+  int used_ = 0;
+};
+
+class BitReader {
+public:
+
+  BitReader(const char* data, size_t size): data_{(const uint8_t*)data}, size_{size} {}
+
+  uint64_t Get(int bits) {
+    uint64_t value = 0;
+
+    while (bits) {
+      if (pos_ >= size_) {
+        error_ = true;
+        return (0);
+      }
+
+      int room = 8 - used_;
+      int take = min(room, bits);
+
+      value = (value << take) | ((data_[pos_] >> (room - take)) & ((1u << take) - 1));
+      used_ += take;
+      bits -= take;
+
+      if (used_ == 8) {
+        pos_++;
+        used_ = 0;
+      }
+    }
+
+    return (value);
+  }
+
+  inline bool Error(void) const { return (error_); }
+
+private:
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_ = 0;
+  int used_ = 0;
+  bool error_ = false;
+};
+
+class StoreCodec {
+public:
+
+  static void EncodeTimestamps(string& out, const vector<int64_t>& timestamp) {
+    BitWriter bits{out};
+    int64_t delta = 0;
+
+    for (size_t idx = 1; idx < timestamp.size(); idx++) {
+      int64_t next = timestamp[idx] - timestamp[idx - 1];
+      int64_t dod = next - delta;
+      uint64_t zigzag = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+
+      if (!zigzag) bits.Put(0b0, 1);
+      else if (zigzag < (1 << 7)) { bits.Put(0b10, 2); bits.Put(zigzag, 7); }
+      else if (zigzag < (1 << 9)) { bits.Put(0b110, 3); bits.Put(zigzag, 9); }
+      else if (zigzag < (1 << 12)) { bits.Put(0b1110, 4); bits.Put(zigzag, 12); }
+      else { bits.Put(0b1111, 4); bits.Put(zigzag, 64); }
+
+      delta = next;
+    }
+
+    bits.Finish();
+  }
+
+  static bool DecodeTimestamps(const char* data, size_t size, int64_t first, size_t count, vector<int64_t>& timestamp) {
+    BitReader bits{data, size};
+    int64_t delta = 0;
+
+    timestamp.resize(count);
+    if (count) timestamp[0] = first;
+
+    for (size_t idx = 1; idx < count && !bits.Error(); idx++) {
+      uint64_t zigzag = 0;
+
+      if (bits.Get(1)) {
+        if (!bits.Get(1)) zigzag = bits.Get(7);
+        else if (!bits.Get(1)) zigzag = bits.Get(9);
+        else if (!bits.Get(1)) zigzag = bits.Get(12);
+        else zigzag = bits.Get(64);
+      }
+
+      // Unsigned arithmetic: a corrupted column wraps around instead of overflowing
+      delta = (int64_t)((uint64_t)delta + ((zigzag >> 1) ^ (0 - (zigzag & 1))));
+      timestamp[idx] = (int64_t)((uint64_t)timestamp[idx - 1] + (uint64_t)delta);
+    }
+
+    return (!bits.Error());
+  }
+
+  static void EncodeValues(string& out, const double* value, size_t count, size_t stride) {
+    //
+    // value[0], value[stride], value[2 * stride], ...: one field of row-major observations
+    //
+    BitWriter bits{out};
+    uint64_t previous = 0;
+    int leading = -1, trailing = 0;
+
+    for (size_t idx = 0; idx < count; idx++) {
+      uint64_t current;
+      memcpy(&current, &value[idx * stride], sizeof(current));
+
+      if (!idx) {
+        bits.Put(current, 64);
+        previous = current;
+        continue;
+      }
+
+      uint64_t x = current ^ previous;
+      previous = current;
+
+      if (!x) {
+        bits.Put(0b0, 1);
+        continue;
+      }
+
+      int lead = min(__builtin_clzll(x), 31);
+      int trail = __builtin_ctzll(x);
+
+      if (leading >= 0 && lead >= leading && trail >= trailing) {
+        bits.Put(0b10, 2);
+        bits.Put(x >> trailing, 64 - leading - trailing);
+      }
+      else {
+        int meaningful = 64 - lead - trail;
+
+        bits.Put(0b11, 2);
+        bits.Put(lead, 5);
+        bits.Put(meaningful - 1, 6);
+        bits.Put(x >> trail, meaningful);
+
+        leading = lead;
+        trailing = trail;
+      }
+    }
+
+    bits.Finish();
+  }
+
+  static bool DecodeValues(const char* data, size_t size, size_t count, double* value, size_t stride) {
+    BitReader bits{data, size};
+    uint64_t previous = 0;
+    int leading = 0, trailing = 0;
+
+    for (size_t idx = 0; idx < count && !bits.Error(); idx++) {
+      if (!idx) previous = bits.Get(64);
+      else if (bits.Get(1)) {
+        if (bits.Get(1)) {
+          int meaningful;
+
+          leading = bits.Get(5);
+          meaningful = (int)bits.Get(6) + 1;
+
+          // Only a corrupted column describes a window wider than the value
+          if (leading + meaningful > 64) return (false);
+          trailing = 64 - leading - meaningful;
+        }
+
+        previous ^= bits.Get(64 - leading - trailing) << trailing;
+      }
+
+      memcpy(&value[idx * stride], &previous, sizeof(previous));
+    }
+
+    return (!bits.Error());
+  }
+};
+
+//
+// Observations of one sensor, written by the decoder that owns it (no locking)
+//
+
+class StoreSeries {
+public:
+
+  static constexpr size_t BLOCK_MAX = 60;                       // observations per block: an hour at one a minute
+
+  StoreSeries(const string& dir = "", string_view hub = "", string_view sensor = "", size_t fields = 0, const string& names = "", atomic<uint64_t>* errors = nullptr):
+    dir_{dir}, hub_{hub}, sensor_{sensor}, fields_{min(fields, StoreBlock::FIELD_MAX)}, names_{names}, errors_{errors} {}
+
+  ~StoreSeries() {
+    Flush();
+    if (fd_ != -1) close(fd_);
+  }
+
+  void Append(time_t timestamp, const double* value) {
+    if (dir_.empty()) return;
+
+    timestamp_.push_back(timestamp);
+    value_.insert(value_.end(), value, value + fields_);
+
+    if (timestamp_.size() == BLOCK_MAX) Flush();
+  }
+
+  void Flush(void) {
+    //
+    // Write the observations buffered so far as one block
+    //
+    if (timestamp_.empty()) return;
+
+    error_t err = Segment(timestamp_[0]);
+
+    if (!err) {
+      StoreBlock block;
+      string column;
+
+      memset(&block, 0, sizeof(block));
+      block.magic = TEMPEST_STORE_BLOCK;
+      block.count = timestamp_.size();
+      block.first = timestamp_.front();
+      block.last = timestamp_.back();
+
+      StoreCodec::EncodeTimestamps(column, timestamp_);
+      block.size[0] = column.size();
+
+      for (size_t field = 0; field < fields_; field++) {
+        size_t size = column.size();
+
+        StoreCodec::EncodeValues(column, &value_[field], timestamp_.size(), fields_);
+        block.size[1 + field] = column.size() - size;
+      }
+
+      column.insert(0, (const char*)&block, sizeof(block));
+      err = Write(fd_, column.data(), column.size());
+    }
+
+    if (err && errors_) errors_->fetch_add(1, memory_order_relaxed);
+
+    timestamp_.clear();
+    value_.clear();
+  }
+
+private:
+
+  error_t Segment(time_t timestamp) {
+    //
+    // Make sure the segment of the month timestamp falls in is open, creating it or repairing its tail if needed
+    //
+    struct tm utc;
+    char month[8];
+
+    gmtime_r(&timestamp, &utc);
+    strftime(month, sizeof(month), "%Y%m", &utc);
+
+    if (fd_ != -1 && month_ == month) return (0);
+
+    if (fd_ != -1) close(fd_);
+    month_ = month;
+
+    string path = dir_ + "/" + sensor_ + "-" + month_ + ".tss";
+    error_t err = 0;
+    struct stat st;
+
+    if ((fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640)) == -1) return (errno);
+
+    if (fstat(fd_, &st) == -1) err = errno;
+    else if (!st.st_size) {
+      StoreHeader header;
+
+      memset(&header, 0, sizeof(header));
+      header.magic = TEMPEST_STORE_MAGIC;
+      header.version = TEMPEST_STORE_VERSION;
+      header.fields = fields_;
+      header.block_size = sizeof(StoreBlock);
+      Snapshot::Copy(header.hub, sizeof(header.hub), hub_);
+      Snapshot::Copy(header.sensor, sizeof(header.sensor), sensor_);
+      Snapshot::Copy(header.names, sizeof(header.names), names_);
+
+      err = Write(fd_, &header, sizeof(header));
+    }
+    else err = Repair(st.st_size);
+
+    if (!err && lseek(fd_, 0, SEEK_END) == -1) err = errno;
+
+    if (err) {
+      close(fd_);
+      fd_ = -1;
+      month_.clear();
+    }
+
+    return (err);
+  }
+
+  error_t Repair(off_t size) {
+    //
+    // Cut a block torn by a crash mid-write: return EPROTO if the segment was written by an incompatible version
+    //
+    StoreHeader header;
+    StoreBlock block;
+    off_t offset = sizeof(header);
+
+    if (pread(fd_, &header, sizeof(header), 0) != sizeof(header)) return (EPROTO);
+    if (header.magic != TEMPEST_STORE_MAGIC || header.version != TEMPEST_STORE_VERSION || header.fields != fields_ || header.block_size != sizeof(StoreBlock)) return (EPROTO);
+
+    while (offset < size) {
+      if (pread(fd_, &block, sizeof(block), offset) != sizeof(block) || block.magic != TEMPEST_STORE_BLOCK || block.count > BLOCK_MAX ||
+          offset + (off_t)sizeof(block) + (off_t)block.Bytes(fields_) > size) break;
+
+      offset += sizeof(block) + block.Bytes(fields_);
+    }
+
+    if (offset < size && ftruncate(fd_, offset) == -1) return (errno);
+
+    return (0);
+  }
+
+  static error_t Write(int fd, const void* data, size_t size) {
+    for (size_t done = 0; done < size; ) {
+      ssize_t len = write(fd, (const char*)data + done, size - done);
+
+      if (len == -1) {
+        if (errno == EINTR) continue;
+        return (errno);
+      }
+      done += len;
+    }
+
+    return (0);
+  }
+
+  const string dir_;                                            // "": not storing
+  const string hub_;
+  const string sensor_;
+  const size_t fields_;
+  const string names_;
+  atomic<uint64_t>* const errors_;
+
+  int fd_ = -1;                                                 // open segment
+  string month_;                                                // of the open segment: yyyymm
+
+  vector<int64_t> timestamp_;                                   // buffered block
+  vector<double> value_;                                        // row-major, fields_ per observation
+};
+
+//
+// Usage (relay):
+//
+// Store store;
+//
+// store.Open("/var/lib/tempest/store", History::FIELD_MAX, names);  // before the decoders start
+// StoreSeries* series = store.Add("HB-00013030", "ST-00000512");     // once per sensor, any decoder
+// series->Append(timestamp, value);                                  // every observation, from that sensor's decoder
+//
+// store.Flush();                                                    // at exit, once the decoders are done
+//
+// A block is written every BLOCK_MAX observations of a sensor and, for what's left, at Flush() or destruction.
+// If not open, for an invalid serial or beyond SERIES_MAX sensors Add() returns a series that discards everything so
+// callers don't need to check
+//
+
+class Store {
+public:
+
+  error_t Open(const string& dir, size_t fields, const string& names) {
+    //
+    // Return a system error if dir doesn't exist and can't be created
+    //
+    if (mkdir(dir.c_str(), 0750) == -1 && errno != EEXIST) return (errno);
+
+    dir_ = dir;
+    fields_ = fields;
+    names_ = names;
+
+    return (0);
+  }
+
+  static constexpr size_t SERIES_MAX = 256;                     // open segments, one fd each
+
+  StoreSeries* Add(string_view hub, string_view sensor) {
+    //
+    // The serial comes from an unauthenticated datagram and names the segment file: only [A-Za-z0-9-] is taken, so it
+    // can never point outside dir, and at most SERIES_MAX sensors are stored so forged serials can't run out of fds
+    //
+    scoped_lock<mutex> lock{access_};
+
+    if (dir_.empty()) return (&discard_);
+
+    if (!Valid(sensor) || series_.size() == SERIES_MAX) {
+      rejected_.fetch_add(1, memory_order_relaxed);
+      return (&discard_);
+    }
+
+    return (&series_.emplace_back(dir_, hub, sensor, fields_, names_, &errors_));
+  }
+
+  void Flush(void) {
+    // Write what every series has buffered: only when no decoder is appending
+    scoped_lock<mutex> lock{access_};
+
+    for (auto& series: series_) series.Flush();
+  }
+
+  static bool Valid(string_view serial) {
+    if (serial.empty() || serial.size() > sizeof(StoreHeader::sensor) - 1) return (false);
+
+    for (char ch: serial) if (!isalnum((unsigned char)ch) && ch != '-') return (false);
+
+    return (true);
+  }
+
+  inline uint64_t Rejected(void) const { return (rejected_.load(memory_order_relaxed)); }
+  inline bool Opened(void) const { return (!dir_.empty()); }
+  inline uint64_t Errors(void) const { return (errors_.load(memory_order_relaxed)); }
+
+private:
+
+  mutex access_;                                                // decoders adding sensors concurrently
+  string dir_;
+  size_t fields_ = 0;
+  string names_;
+  atomic<uint64_t> errors_{0};                                  // blocks that could not be written
+  atomic<uint64_t> rejected_{0};                                // sensors not stored: invalid serial or too many
+  deque<StoreSeries> series_;                                   // pointer-stable
+  StoreSeries discard_;
+};
+
+//
+// Usage (consumer):
+//
+// StoreReader reader;
+//
+// if (!reader.Open(path)) {                                    // ENOENT: no such file, EPROTO: not a segment
+//   reader.Read([](int64_t timestamp, const double* value) { ... });  // value[reader.Header().fields]
+// }
+//
+
+class StoreReader {
+public:
+
+  ~StoreReader() {
+    if (addr_ != MAP_FAILED) munmap(addr_, size_);
+  }
+
+  error_t Open(const string& path) {
+    error_t err = 0;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) return (errno);
+
+    if (fstat(fd, &st) == -1) err = errno;
+    else if ((size_t)st.st_size < sizeof(StoreHeader)) err = EPROTO;
+    else if ((addr_ = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) err = errno;
+    else {
+      size_ = st.st_size;
+
+      const StoreHeader& header = Header();
+      if (header.magic != TEMPEST_STORE_MAGIC || header.version != TEMPEST_STORE_VERSION || header.block_size != sizeof(StoreBlock) || header.fields > StoreBlock::FIELD_MAX) err = EPROTO;
+    }
+
+    close(fd);
+
+    return (err);
+  }
+
+  inline const StoreHeader& Header(void) const { return (*(const StoreHeader*)addr_); }
+
+  template<typename F>
+  error_t Read(const F& visit) const {
+    //
+    // Call visit(timestamp, value) for every observation in order: return EPROTO at the first corrupted block
+    // (a torn block at the end of a segment still being written is not an error)
+    //
+    const char* data = (const char*)addr_;
+    uint32_t fields = Header().fields;
+    size_t offset = sizeof(StoreHeader);
+
+    vector<int64_t> timestamp;
+    vector<double> value;
+
+    while (offset + sizeof(StoreBlock) <= size_) {
+      StoreBlock block;
+      memcpy(&block, data + offset, sizeof(block));
+
+      if (block.magic != TEMPEST_STORE_BLOCK || block.count > StoreSeries::BLOCK_MAX) return (EPROTO);
+      if (offset + sizeof(block) + block.Bytes(fields) > size_) break;
+
+      const char* column = data + offset + sizeof(block);
+
+      if (!StoreCodec::DecodeTimestamps(column, block.size[0], block.first, block.count, timestamp)) return (EPROTO);
+      column += block.size[0];
+
+      value.resize((size_t)block.count * fields);
+      for (uint32_t field = 0; field < fields; field++) {
+        if (!StoreCodec::DecodeValues(column, block.size[1 + field], block.count, &value[field], fields)) return (EPROTO);
+        column += block.size[1 + field];
+      }
+
+      for (uint32_t idx = 0; idx < block.count; idx++) visit(timestamp[idx], &value[(size_t)idx * fields]);
+
+      offset += sizeof(block) + block.Bytes(fields);
+    }
+
+    return (0);
+  }
+
+private:
+
+  void* addr_ = MAP_FAILED;
+  size_t size_ = 0;
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_STORE
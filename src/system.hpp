@@ -17,6 +17,7 @@
 #include <fstream>
 #include <ostream>
 #include <streambuf>
+#include <iomanip>
 
 #include <cstdio>
 #include <ctime>
@@ -28,11 +29,18 @@
 #include <limits>
 
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <regex>
 
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <array>
 #include <map>
 #include <initializer_list>
+#include <algorithm>
+#include <random>
 
 #include <chrono>
 #include <thread>
@@ -54,12 +62,20 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/shm.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #include <semaphore.h>
 #include <fcntl.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include <dirent.h>
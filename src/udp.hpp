@@ -0,0 +1,375 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: zero-allocation streaming decoder for Tempest UDP JSON messages
+// API:         https://weatherflow.github.io/SmartWeather/api/udp.html
+//
+
+#ifndef TEMPEST_UDP
+#define TEMPEST_UDP
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+// Event types: known events first so they can index the type tag table
+
+enum UdpEvent {
+  UDP_OBS_ST = 0,
+  UDP_OBS_AIR,
+  UDP_OBS_SKY,
+  UDP_RAPID_WIND,
+  UDP_EVT_PRECIP,
+  UDP_EVT_STRIKE,
+  UDP_DEVICE_STATUS,
+  UDP_HUB_STATUS,
+
+  UDP_DEBUG,                                                    // *_debug, discarded
+  UDP_UNKNOWN,                                                  // well formed but unrecognized
+  UDP_INVALID,                                                  // malformed
+
+  UDP_EVENT_MAX
+};
+
+//
+// Tempest UDP messages are flat JSON objects whose values are strings, numbers, arrays of numbers or (obs) arrays of arrays
+// of numbers. UdpMessage scans the datagram once, in place, and stores only the keys we care about: strings are views into
+// the datagram and numbers are converted with from_chars(), so nothing is ever allocated. Unknown keys are skipped.
+//
+// Usage:
+//
+// UdpMessage msg;
+// if (msg.Parse(udp, udp_len) && msg.event == UDP_OBS_ST) cout << msg.type << " " << msg.obs[0][7] << endl;
+//
+// The type tag is classified as soon as it is scanned with a minimal perfect hash over the known tags; debug events stop
+// the scan right there.
+//
+
+class UdpMessage {
+public:
+
+  static constexpr size_t FIELD_MAX = 32;                       // max numbers in an array
+  static constexpr size_t OBS_MAX = 32;                         // max observations in a message
+
+  class Array {
+  public:
+    // Missing and null values read as 0 (same as json11 number_value())
+    inline double operator[](size_t idx) const { return ((idx < size)? value[idx]: 0); }
+
+    double value[FIELD_MAX];
+    size_t size;
+  };
+
+  static inline const char* Tag(UdpEvent event) {
+    return ((event < UDP_DEBUG)? tag_[event]: (event == UDP_DEBUG)? "debug": (event == UDP_UNKNOWN)? "unknown": "invalid");
+  }
+
+  static UdpEvent Classify(const string_view& type) {
+    //
+    // One hash, one table lookup and one string compare for the known tags
+    //
+    if (type.size() >= TAG_MIN) {
+      UdpEvent event = slot_[Hash(type.data(), type.size())];
+      if (type == tag_[event]) return (event);
+    }
+
+    if (type.find("debug") != string_view::npos) return (UDP_DEBUG);
+
+    return (UDP_UNKNOWN);
+  }
+
+  static constexpr bool Perfect(void) {
+    // Compile time check that every known tag gets its own slot
+    array<UdpEvent, UDP_DEBUG> slot = Slots();
+    for (size_t idx = 0; idx < UDP_DEBUG; idx++) if (slot[Hash(tag_[idx], Length(tag_[idx]))] != (UdpEvent)idx) return (false);
+    return (true);
+  }
+
+  bool Parse(const char udp[], size_t udp_len) {
+    //
+    // Return false if the datagram is not a well formed flat JSON object or exceeds our fixed capacity
+    // Debug events return true as soon as their type is scanned: anything after it is left unparsed
+    //
+    Clear();
+
+    pos_ = udp;
+    end_ = udp + udp_len;
+
+    if (!Expect('{')) return (false);
+    if (Expect('}')) return (true);
+
+    do {
+      string_view key;
+      if (!ParseString(key) || !Expect(':')) return (false);
+
+      bool ok;
+
+      switch (Key(key)) {
+      case KEY_TYPE:
+        if (!(ok = ParseString(type))) break;
+        if ((event = Classify(type)) == UDP_DEBUG) return (true);
+        break;
+
+      case KEY_SERIAL_NUMBER:     ok = ParseString(serial_number); break;
+      case KEY_HUB_SN:            ok = ParseString(hub_sn); break;
+      case KEY_RESET_FLAGS:       ok = ParseString(reset_flags); break;
+      case KEY_FIRMWARE_REVISION: ok = ParseNumberOrString(firmware_revision); break;
+      case KEY_TIMESTAMP:         ok = ParseNumber(timestamp); break;
+      case KEY_UPTIME:            ok = ParseNumber(uptime); break;
+      case KEY_VOLTAGE:           ok = ParseNumber(voltage); break;
+      case KEY_RSSI:              ok = ParseNumber(rssi); break;
+      case KEY_SENSOR_STATUS:     ok = ParseNumber(sensor_status); break;
+      case KEY_DEBUG:             ok = ParseNumber(debug); break;
+      case KEY_SEQ:               ok = ParseNumber(seq); break;
+      case KEY_OB:                ok = ParseArray(ob); break;
+      case KEY_EVT:               ok = ParseArray(evt); break;
+      case KEY_FS:                ok = ParseArray(fs); break;
+      case KEY_RADIO_STATS:       ok = ParseArray(radio_stats); break;
+      case KEY_MQTT_STATS:        ok = ParseArray(mqtt_stats); break;
+      case KEY_OBS:               ok = ParseObservations(); break;
+      default:                    ok = SkipValue(0); break;
+      }
+
+      if (!ok) return (false);
+    }
+    while (Expect(','));
+
+    return (Expect('}'));
+  }
+
+  UdpEvent event;                                               // classified type
+
+  string_view type;
+  string_view serial_number;
+  string_view hub_sn;
+  string_view reset_flags;
+
+  double firmware_revision;
+  double timestamp;
+  double uptime;
+  double voltage;
+  double rssi;
+  double sensor_status;
+  double debug;
+  double seq;
+
+  Array ob;
+  Array evt;
+  Array fs;
+  Array radio_stats;
+  Array mqtt_stats;
+
+  Array obs[OBS_MAX];
+  size_t obs_size;
+
+private:
+
+  // Type tags, indexed by UdpEvent
+  static constexpr size_t TAG_MIN = 6;
+  static constexpr const char* tag_[UDP_DEBUG] = {
+    "obs_st", "obs_air", "obs_sky", "rapid_wind", "evt_precip", "evt_strike", "device_status", "hub_status"
+  };
+
+  static constexpr size_t Hash(const char* tag, size_t len) {
+    // Minimal perfect hash of the known tags into [0, UDP_DEBUG): verified below
+    return ((tag[2] + (tag[5] * 7) + len) & (UDP_DEBUG - 1));
+  }
+
+  static constexpr size_t Length(const char* tag) {
+    size_t len = 0;
+    while (tag[len]) len++;
+    return (len);
+  }
+
+  static constexpr array<UdpEvent, UDP_DEBUG> Slots(void) {
+    array<UdpEvent, UDP_DEBUG> slot{};
+    for (size_t idx = 0; idx < UDP_DEBUG; idx++) slot[Hash(tag_[idx], Length(tag_[idx]))] = (UdpEvent)idx;
+    return (slot);
+  }
+
+  static const array<UdpEvent, UDP_DEBUG> slot_;                // see initialization below
+
+  enum Field {
+    KEY_UNKNOWN = 0,
+    KEY_TYPE, KEY_SERIAL_NUMBER, KEY_HUB_SN, KEY_RESET_FLAGS, KEY_FIRMWARE_REVISION, KEY_TIMESTAMP, KEY_UPTIME, KEY_VOLTAGE,
+    KEY_RSSI, KEY_SENSOR_STATUS, KEY_DEBUG, KEY_SEQ, KEY_OB, KEY_EVT, KEY_FS, KEY_RADIO_STATS, KEY_MQTT_STATS, KEY_OBS
+  };
+
+  static Field Key(const string_view& key) {
+    // Length first so we compare at most a couple of strings
+    switch (key.size()) {
+    case 2:  if (key == "ob") return (KEY_OB); if (key == "fs") return (KEY_FS); break;
+    case 3:  if (key == "evt") return (KEY_EVT); if (key == "obs") return (KEY_OBS); if (key == "seq") return (KEY_SEQ); break;
+    case 4:  if (key == "type") return (KEY_TYPE); if (key == "rssi") return (KEY_RSSI); break;
+    case 5:  if (key == "debug") return (KEY_DEBUG); break;
+    case 6:  if (key == "hub_sn") return (KEY_HUB_SN); if (key == "uptime") return (KEY_UPTIME); break;
+    case 7:  if (key == "voltage") return (KEY_VOLTAGE); break;
+    case 9:  if (key == "timestamp") return (KEY_TIMESTAMP); break;
+    case 10: if (key == "mqtt_stats") return (KEY_MQTT_STATS); break;
+    case 11: if (key == "reset_flags") return (KEY_RESET_FLAGS); if (key == "radio_stats") return (KEY_RADIO_STATS); break;
+    case 13: if (key == "serial_number") return (KEY_SERIAL_NUMBER); if (key == "sensor_status") return (KEY_SENSOR_STATUS); break;
+    case 17: if (key == "firmware_revision") return (KEY_FIRMWARE_REVISION); break;
+    }
+
+    return (KEY_UNKNOWN);
+  }
+
+  void Clear(void) {
+    event = UDP_UNKNOWN;
+    type = serial_number = hub_sn = reset_flags = string_view{};
+    firmware_revision = timestamp = uptime = voltage = rssi = sensor_status = debug = seq = 0;
+    ob.size = evt.size = fs.size = radio_stats.size = mqtt_stats.size = 0;
+    obs_size = 0;
+  }
+
+  inline void SkipSpace(void) {
+    while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) pos_++;
+  }
+
+  inline bool Expect(char c) {
+    SkipSpace();
+    if (pos_ < end_ && *pos_ == c) { pos_++; return (true); }
+    return (false);
+  }
+
+  bool ParseString(string_view& str) {
+    // Escapes are left in place: none of the values we use ever contain them
+    if (!Expect('"')) return (false);
+
+    const char* begin = pos_;
+    while (pos_ < end_ && *pos_ != '"') {
+      if (*pos_ == '\\') pos_++;
+      pos_++;
+    }
+    if (pos_ >= end_) return (false);
+
+    str = string_view{begin, (size_t)(pos_++ - begin)};
+    return (true);
+  }
+
+  bool ParseNumber(double& num) {
+    SkipSpace();
+    if (pos_ >= end_) return (false);
+
+    // Literals
+    if (*pos_ == 'n' || *pos_ == 'f') { num = 0; return (SkipLiteral()); }
+    if (*pos_ == 't') { num = 1; return (SkipLiteral()); }
+
+    from_chars_result res = from_chars(pos_, end_, num);
+    if (res.ec != errc()) return (false);
+
+    pos_ = res.ptr;
+    return (true);
+  }
+
+  bool ParseNumberOrString(double& num) {
+    // Hubs report their firmware revision as a string, sensors as a number
+    SkipSpace();
+    if (pos_ < end_ && *pos_ == '"') {
+      string_view str;
+      if (!ParseString(str)) return (false);
+
+      num = 0;
+      from_chars(str.data(), str.data() + str.size(), num);
+      return (true);
+    }
+
+    return (ParseNumber(num));
+  }
+
+  bool ParseArray(Array& arr) {
+    arr.size = 0;
+
+    if (!Expect('[')) return (false);
+    if (Expect(']')) return (true);
+
+    do {
+      if (arr.size == FIELD_MAX || !ParseNumber(arr.value[arr.size++])) return (false);
+    }
+    while (Expect(','));
+
+    return (Expect(']'));
+  }
+
+  bool ParseObservations(void) {
+    obs_size = 0;
+
+    if (!Expect('[')) return (false);
+    if (Expect(']')) return (true);
+
+    do {
+      if (obs_size == OBS_MAX || !ParseArray(obs[obs_size++])) return (false);
+    }
+    while (Expect(','));
+
+    return (Expect(']'));
+  }
+
+  bool SkipLiteral(void) {
+    while (pos_ < end_ && *pos_ >= 'a' && *pos_ <= 'z') pos_++;
+    return (true);
+  }
+
+  bool SkipValue(int depth) {
+    //
+    // Skip any JSON value of a key we don't use
+    //
+    if (depth > 8) return (false);
+
+    SkipSpace();
+    if (pos_ >= end_) return (false);
+
+    if (*pos_ == '"') {
+      string_view str;
+      return (ParseString(str));
+    }
+
+    if (*pos_ == '[' || *pos_ == '{') {
+      char close = (*pos_++ == '[')? ']': '}';
+
+      if (Expect(close)) return (true);
+
+      do {
+        if (close == '}') {
+          string_view key;
+          if (!ParseString(key) || !Expect(':')) return (false);
+        }
+        if (!SkipValue(depth + 1)) return (false);
+      }
+      while (Expect(','));
+
+      return (Expect(close));
+    }
+
+    double num;
+    return (ParseNumber(num));
+  }
+
+  const char* pos_;
+  const char* end_;
+};
+
+const array<UdpEvent, UDP_DEBUG> UdpMessage::slot_ = UdpMessage::Slots();
+
+static_assert(UdpMessage::Perfect(), "UdpMessage::Hash() is not a perfect hash of the type tags");
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_UDP
@@ -0,0 +1,156 @@
+//
+// App:         WeatherFlow Tempest UDP Relay
+// Author:      Mirco Caramori
+// Copyright:   (c) 2020 Mirco Caramori
+// Repository:  https://github.com/padus/tempest
+//
+// Description: single-pass JSON writer into a reusable buffer
+//
+
+#ifndef TEMPEST_WRITER
+#define TEMPEST_WRITER
+
+// Includes --------------------------------------------------------------------------------------------------------------------
+
+#include "system.hpp"
+
+// Source ----------------------------------------------------------------------------------------------------------------------
+
+namespace tempest {
+
+using namespace std;
+
+//
+// Usage:
+//
+// JsonWriter json;
+//
+// json.Clear();
+// json.BeginObject().Field("timestamp", 1588948614).Key("obs").BeginArray().Value(22.37).EndArray().EndObject();
+// string_view text = json.View();                               // {"timestamp":1588948614,"obs":[22.37]}
+//
+// Separators are tracked as we go so nothing is ever built twice: no DOM, no dump(). Doubles use the shortest
+// representation that round-trips and non-finite values are written as null
+//
+
+class JsonWriter {
+public:
+
+  JsonWriter(void) {
+    buffer_.reserve(1024);
+  }
+
+  inline void Clear(void) {
+    buffer_.clear();
+    first_ = true;
+    key_ = false;
+  }
+
+  inline string_view View(void) const { return (buffer_); }
+  inline const string& Str(void) const { return (buffer_); }
+  inline size_t Size(void) const { return (buffer_.size()); }
+
+  inline JsonWriter& BeginObject(void) { Separator(); buffer_ += '{'; first_ = true; return (*this); }
+  inline JsonWriter& EndObject(void) { buffer_ += '}'; first_ = false; return (*this); }
+  inline JsonWriter& BeginArray(void) { Separator(); buffer_ += '['; first_ = true; return (*this); }
+  inline JsonWriter& EndArray(void) { buffer_ += ']'; first_ = false; return (*this); }
+
+  inline JsonWriter& Key(string_view key) {
+    Separator();
+    String(key);
+    buffer_ += ':';
+    key_ = true;
+    return (*this);
+  }
+
+  inline JsonWriter& Value(double value) {
+    Separator();
+    if (!isfinite(value)) buffer_ += "null";
+    else {
+      char text[32];
+      buffer_.append(text, to_chars(text, text + sizeof(text), value).ptr - text);
+    }
+    return (*this);
+  }
+
+  template<typename T, typename enable_if<is_integral<T>::value && !is_same<T, bool>::value, int>::type = 0>
+  inline JsonWriter& Value(T value) {
+    char text[24];
+    Separator();
+    buffer_.append(text, to_chars(text, text + sizeof(text), value).ptr - text);
+    return (*this);
+  }
+
+  inline JsonWriter& Value(bool value) {
+    Separator();
+    buffer_ += value? "true": "false";
+    return (*this);
+  }
+
+  inline JsonWriter& Value(string_view value) {
+    Separator();
+    String(value);
+    return (*this);
+  }
+
+  inline JsonWriter& Value(const string& value) { return (Value(string_view{value})); }
+  inline JsonWriter& Value(const char* value) { return (Value(string_view{value})); }
+
+  inline JsonWriter& Null(void) {
+    Separator();
+    buffer_ += "null";
+    return (*this);
+  }
+
+  template<typename T>
+  inline JsonWriter& Field(string_view key, const T& value) {
+    Key(key);
+    return (Value(value));
+  }
+
+private:
+
+  inline void Separator(void) {
+    // A value right after its key, or the first element of a container, needs no comma
+    if (key_) key_ = false;
+    else if (first_) first_ = false;
+    else buffer_ += ',';
+  }
+
+  void String(string_view text) {
+    static const char hex[] = "0123456789abcdef";
+
+    buffer_ += '"';
+
+    for (unsigned char ch: text) {
+      if (ch == '"' || ch == '\\') {
+        buffer_ += '\\';
+        buffer_ += ch;
+      }
+      else if (ch < 0x20) {
+        buffer_ += "\\u00";
+        buffer_ += hex[ch >> 4];
+        buffer_ += hex[ch & 0xf];
+      }
+      else buffer_ += ch;
+    }
+
+    buffer_ += '"';
+  }
+
+  string buffer_;
+  bool first_ = true;                                           // next element is the first of its container
+  bool key_ = false;                                            // a key was just written
+};
+
+} // namespace tempest
+
+// Recycle Bin ----------------------------------------------------------------------------------------------------------------
+
+/*
+
+*/
+
+// EOF ------------------------------------------------------------------------------------------------------------------------
+
+#endif // TEMPEST_WRITER